@@ -1,9 +1,15 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
 #include "alterations.h"
+#include "summary.h"
+
+#define META_SET_TEMPO 0x51
+#define DEFAULT_TEMPO 500000
+#define MAX_TEMPO 0xFFFFFF
 
 int apply_to_events(song_data_t *song, event_func_t func, void *data) {
     int sum = 0;
@@ -15,20 +21,74 @@ int apply_to_events(song_data_t *song, event_func_t func, void *data) {
     return sum;
 }
 
-int change_event_octave(event_t *event, int *octaves) {
-    if (event->type != NOTE_ON && event->type != NOTE_OFF && event->type != POLY_PRESSURE) {
-        return 0;
+/*
+ * Scale a tempo in microseconds per quarter note into scaled. Returns false
+ * if the result does not fit the 24 bits a Set Tempo event can hold, in
+ * which case scaled is left alone.
+ */
+static bool scale_tempo(uint32_t tempo, float multiplier, uint32_t *scaled) {
+    double result = (double) tempo * multiplier + 0.5;
+    if (result < 1 || result > MAX_TEMPO) {
+        return false;
     }
-    
-    int note_value = event->midi_data[0] & 0x7F; // extract note value from first byte of MIDI data
-    int new_octave = (note_value + (*octaves * 12)) / 12; // calculate new octave based on original note value and number of octaves to change
+    *scaled = (uint32_t) result;
+    return true;
+}
+
+/*
+ * Return the meta event if the event is a well formed Set Tempo, else NULL.
+ */
+static meta_event_t *get_set_tempo(event_t *event) {
+    if (event->type != META_EVENT) {
+        return NULL;
+    }
+    meta_event_t *meta_event = (meta_event_t *) event->data;
+    if (meta_event->type != META_SET_TEMPO || meta_event->length != 3) {
+        return NULL;
+    }
+    return meta_event;
+}
+
+static uint32_t read_tempo(const meta_event_t *meta_event) {
+    return ((uint32_t) meta_event->data[0] << 16) |
+           ((uint32_t) meta_event->data[1] << 8) |
+           (uint32_t) meta_event->data[2];
+}
+
+static void write_tempo(meta_event_t *meta_event, uint32_t tempo) {
+    meta_event->data[0] = (tempo >> 16) & 0xFF;
+    meta_event->data[1] = (tempo >> 8) & 0xFF;
+    meta_event->data[2] = tempo & 0xFF;
+}
+
+/*
+ * Returns note_value moved by the given number of octaves, or -1 if that
+ * would leave the valid octave range.
+ */
+static int shift_note_octave(int note_value, int octaves) {
+    int new_octave = (note_value + (octaves * 12)) / 12; // calculate new octave based on original note value and number of octaves to change
     
     if (new_octave < 0 || new_octave > 10) { // check if new octave is within valid range
-        return 0;
+        return -1;
     }
     
     note_value = note_value % 12; // get the new note value within the current octave
     note_value += new_octave * 12; // calculate the final note value in the new octave
+    if (note_value > 127) { // the top octave stops at G
+        return -1;
+    }
+    return note_value;
+}
+
+int change_event_octave(event_t *event, int *octaves) {
+    if (event->type != NOTE_ON && event->type != NOTE_OFF && event->type != POLY_PRESSURE) {
+        return 0;
+    }
+    
+    int note_value = shift_note_octave(event->midi_data[0] & 0x7F, *octaves); // extract note value from first byte of MIDI data
+    if (note_value == -1) {
+        return 0;
+    }
     
     event->midi_data[0] &= 0xF0; // clear the note value bits from the first byte of MIDI data
     event->midi_data[0] |= note_value; // set the new note value in the first byte of MIDI data
@@ -83,6 +143,13 @@ int change_octave(song_data_t *song, int num_octaves) {
     // apply change_event_octave function to each event in the song
     modified_events = apply_to_events(song, change_event_octave, &num_octaves);
 
+    // move the note counts the same way
+    int mapping[128];
+    for (int i = 0; i < 128; i++) {
+        mapping[i] = shift_note_octave(i, num_octaves);
+    }
+    summary_remap_notes(&song->summary, mapping);
+
     return modified_events;
 }
 int warp_time(song_data_t *song, float multiplier) {
@@ -91,15 +158,22 @@ int warp_time(song_data_t *song, float multiplier) {
 
     // Update the delta time of each event based on the multiplier
     int delta_time_diff = 0;
+    uint32_t total_ticks = 0;
     for (int i = 0; i < song->num_tracks; i++) {
         track_data_t *track = song->tracks[i];
+        uint32_t track_ticks = 0;
         for (int j = 0; j < track->num_events; j++) {
             event_t *event = track->events[j];
             int old_delta_time = event->delta_time;
             event->delta_time = (int) (event->delta_time * multiplier);
             delta_time_diff += get_delta_time_length(event->delta_time) - get_delta_time_length(old_delta_time);
+            track_ticks += event->delta_time;
+        }
+        if (track_ticks > total_ticks) {
+            total_ticks = track_ticks;
         }
     }
+    song->summary.total_ticks = total_ticks;
 
     // Update the length of each track based on the new time division and the new delta times
     int length_diff = 0;
@@ -116,6 +190,102 @@ int warp_time(song_data_t *song, float multiplier) {
     // Calculate the difference in bytes between the new and old representations of the song
     return delta_time_diff + length_diff + get_header_length(song->header) + get_tracks_length(song);
 }
+/*
+ * Change the speed of the song by rescaling its Set Tempo events, leaving
+ * every delta time alone. A multiplier of 2 makes the song twice as long,
+ * just like warp_time, but timing stays exact and only Set Tempo events are
+ * touched. They are scaled in whichever track they are found, since not
+ * every file keeps them in the first one. If the song does not set a tempo
+ * at its very start, a Set Tempo event for the scaled default tempo is
+ * inserted at the start of the first track. A song without tracks is left
+ * alone.
+ *
+ * Songs using SMPTE division or format 2 have no single tempo map, and a
+ * tempo scaled past the 24 bits of a Set Tempo event would change the
+ * song's length by the wrong amount, so those songs go through warp_time
+ * instead.
+ *
+ * Returns the difference in bytes between the new and old representations
+ * of the song.
+ */
+int warp_tempo(song_data_t *song, float multiplier) {
+    assert(song != NULL && multiplier > 0);
+    if (song->format == 2 || (song->ticks_per_quarter_note & 0x8000)) {
+        return warp_time(song, multiplier);
+    }
+
+    if (song->track_list == NULL) {
+        return 0;
+    }
+
+    // Check every tempo first so the song is left untouched if one would
+    // not fit in a Set Tempo event.
+    bool tempo_at_start = false;
+    uint32_t tempo = 0;
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        uint32_t tick = 0;
+        for (event_node_t *node = track_node->track->event_list; node != NULL; node = node->next) {
+            tick += node->event->delta_time;
+            meta_event_t *meta_event = get_set_tempo(node->event);
+            if (meta_event == NULL) {
+                continue;
+            }
+            if (!scale_tempo(read_tempo(meta_event), multiplier, &tempo)) {
+                return warp_time(song, multiplier);
+            }
+            if (tick == 0) {
+                tempo_at_start = true;
+            }
+        }
+    }
+    uint32_t start_tempo = 0;
+    if (!tempo_at_start && !scale_tempo(DEFAULT_TEMPO, multiplier, &start_tempo)) {
+        return warp_time(song, multiplier);
+    }
+
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        for (event_node_t *node = track_node->track->event_list; node != NULL; node = node->next) {
+            meta_event_t *meta_event = get_set_tempo(node->event);
+            if (meta_event != NULL) {
+                scale_tempo(read_tempo(meta_event), multiplier, &tempo);
+                write_tempo(meta_event, tempo);
+            }
+        }
+    }
+
+    if (tempo_at_start) {
+        return 0;
+    }
+
+    // Insert a Set Tempo event at tick 0, ahead of the first event
+    track_t *conductor = song->track_list->track;
+    meta_event_t *meta_event = malloc(sizeof(meta_event_t));
+    assert(meta_event != NULL);
+    meta_event->type = META_SET_TEMPO;
+    meta_event->length = 3;
+    meta_event->data = malloc(3);
+    assert(meta_event->data != NULL);
+    write_tempo(meta_event, start_tempo);
+
+    event_t *event = malloc(sizeof(event_t));
+    assert(event != NULL);
+    event->delta_time = 0;
+    event->type = META_EVENT;
+    event->length = 3;
+    event->data = meta_event;
+    event->name = "Set Tempo";
+
+    event_node_t *node = malloc(sizeof(event_node_t));
+    assert(node != NULL);
+    node->event = event;
+    node->next = conductor->event_list;
+    conductor->event_list = node;
+
+    // delta time, 0xFF, type, length and three data bytes
+    int added_bytes = 7;
+    conductor->length += added_bytes;
+    return added_bytes;
+}
 int remap_instruments(song_data_t *song, remapping_t mapping)
 {
     int num_events_modified = 0;
@@ -133,6 +303,7 @@ int remap_instruments(song_data_t *song, remapping_t mapping)
             }
         }
     }
+    summary_remap_programs(&song->summary, mapping);
 
     return num_events_modified;
 }
@@ -151,24 +322,17 @@ int remap_notes(song_data_t *song, remapping_t mapping) {
             }
         }
     }
+    summary_remap_notes(&song->summary, mapping);
     return num_modified_events;
 }
 void add_round(song_data_t *song, int track_index, int octave_diff, unsigned int delay, uint8_t instrument) {
     assert(track_index >= 0 && track_index < song->num_tracks); // check if track index is valid
     assert(song->format != 2); // check if song format is not 2
-    assert(song->num_channels < 16); // check if song has not already used all its channel values
     
     // Find smallest available MIDI channel in the song
-    uint8_t available_channel = 0;
-    for (int i = 0; i < song->num_tracks; i++) {
-        track_t *t = &song->tracks[i];
-        for (int j = 0; j < t->event_count; j++) {
-            if (t->events[j].type == MIDI_CHANNEL_EVENT && t->events[j].midi_data.channel == available_channel) {
-                available_channel++;
-                j = -1; // reset the inner loop to check all events again with new available channel
-            }
-        }
-    }
+    int free_channel = summary_first_free_channel(&song->summary);
+    assert(free_channel != -1); // check if song has not already used all its channel values
+    uint8_t available_channel = (uint8_t) free_channel;
     
     // Create a copy of the track
     track_t *original_track = &song->tracks[track_index];
@@ -205,6 +369,9 @@ void add_round(song_data_t *song, int track_index, int octave_diff, unsigned int
         e->delta_time += delay;
     }
     
+    // Count the new track's channel, notes, programs and length
+    summary_add_track(&song->summary, new_track);
+    
     // Add the new track to the song
     song->tracks[song->num_tracks] = *new_track;
     song->num_tracks++;
@@ -213,7 +380,6 @@ void add_round(song_data_t *song, int track_index, int octave_diff, unsigned int
     song->format = (song->num_tracks > 1) ? 1 : 0; // update song format
     song->division = original_track->division; // set song division to original track's division
     song->total_time += new_track->length; // update song length
-    song->num_channels++; // increment channel count
     
     // Free memory allocated for the new track
     free(new_track);
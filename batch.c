@@ -0,0 +1,561 @@
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include "alterations.h"
+#include "loader.h"
+#include "parser.h"
+#include "writer.h"
+
+/**
+ * This file contains the batch tool, which applies a list of alterations to
+ * many MIDI files at once.
+ *
+ * Work flows through four stages connected by bounded queues:
+ *
+ *   read -> parse -> transform -> write
+ *
+ * read is driven by the asynchronous loader. Each other stage runs its own
+ * number of worker threads. A full queue blocks the stage feeding it, so a
+ * slow stage holds back the ones before it, and memory stays bounded by the
+ * queue capacities. At the end the tool reports per-stage throughput.
+ *
+ * Each result is written to OUTPUT_DIR under its input's base name, so the
+ * inputs must all have different base names.
+ *
+ * Usage: batch [options] OUTPUT_DIR FILE...
+ */
+
+#define DEFAULT_IO_DEPTH 32
+#define DEFAULT_QUEUE_CAPACITY 64
+
+typedef enum {
+    TRANSFORM_OCTAVE,
+    TRANSFORM_WARP_TIME,
+    TRANSFORM_WARP_TEMPO,
+    TRANSFORM_INSTRUMENT,
+    TRANSFORM_NOTE
+} transform_kind_t;
+
+typedef struct {
+    transform_kind_t kind;
+    int octaves;
+    float multiplier;
+    int from;
+    int to;
+} transform_t;
+
+typedef struct {
+    char *path;
+    uint8_t *data;
+    size_t size;
+    song_data_t *song;
+} job_t;
+
+typedef struct {
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    // stages still pushing; the queue is closed when this reaches 0
+    int producers;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} bounded_queue_t;
+
+typedef struct stage stage_t;
+// Returns the job to hand to the next stage, or frees it and returns NULL
+// if it failed. Only jobs that are handed on count as processed.
+typedef job_t *(*stage_func_t)(stage_t *, job_t *);
+
+struct stage {
+    const char *name;
+    int num_workers;
+    stage_func_t process;
+    bounded_queue_t *input;
+    bounded_queue_t *output;
+    pthread_t *threads;
+
+    atomic_ullong items;
+    atomic_ullong bytes;
+    atomic_ullong busy_ns;
+    atomic_ullong blocked_ns;
+    uint64_t start_ns;
+    atomic_ullong end_ns;
+};
+
+static transform_t *g_transforms = NULL;
+static int g_num_transforms = 0;
+static const char *g_output_dir = NULL;
+static const char **g_paths = NULL;
+static int g_num_paths = 0;
+static int g_io_depth = DEFAULT_IO_DEPTH;
+static atomic_int g_num_errors = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static bounded_queue_t *new_queue(int capacity, int producers) {
+    bounded_queue_t *queue = malloc(sizeof(bounded_queue_t));
+    assert(queue != NULL);
+    queue->items = malloc(capacity * sizeof(void *));
+    assert(queue->items != NULL);
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->producers = producers;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return queue;
+}
+
+static void free_queue(bounded_queue_t *queue) {
+    assert(queue->count == 0);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+    free(queue);
+}
+
+/*
+ * Push an item, waiting while the queue is full. Returns the time spent
+ * waiting in nanoseconds.
+ */
+static uint64_t queue_push(bounded_queue_t *queue, void *item) {
+    uint64_t blocked_ns = 0;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        uint64_t start = now_ns();
+        while (queue->count == queue->capacity) {
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        }
+        blocked_ns = now_ns() - start;
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return blocked_ns;
+}
+
+/*
+ * Pop an item, waiting while the queue is empty. Returns NULL once the queue
+ * is empty and every producer is done.
+ */
+static void *queue_pop(bounded_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && queue->producers > 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    void *item = NULL;
+    if (queue->count > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+static void queue_producer_done(bounded_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    assert(queue->producers > 0);
+    if (--queue->producers == 0) {
+        pthread_cond_broadcast(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void free_job(job_t *job) {
+    free(job->path);
+    free(job->data);
+    free_song(job->song);
+    free(job);
+}
+
+static void stage_finish_worker(stage_t *stage) {
+    atomic_store(&stage->end_ns, now_ns());
+    if (stage->output != NULL) {
+        queue_producer_done(stage->output);
+    }
+}
+
+static void hand_off(stage_t *stage, job_t *job) {
+    if (stage->output != NULL) {
+        atomic_fetch_add(&stage->blocked_ns, queue_push(stage->output, job));
+    } else {
+        free_job(job);
+    }
+}
+
+static void *stage_worker(void *arg) {
+    stage_t *stage = (stage_t *) arg;
+    job_t *job;
+    while ((job = (job_t *) queue_pop(stage->input)) != NULL) {
+        uint64_t start = now_ns();
+        job = stage->process(stage, job);
+        atomic_fetch_add(&stage->busy_ns, now_ns() - start);
+        if (job != NULL) {
+            atomic_fetch_add(&stage->items, 1);
+            hand_off(stage, job);
+        }
+    }
+    stage_finish_worker(stage);
+    return NULL;
+}
+
+static void enqueue_loaded_file(file_buffer_t *buffer, void *data) {
+    stage_t *stage = (stage_t *) data;
+    if (buffer->error != 0) {
+        fprintf(stderr, "Warning: could not read '%s': %s\n", buffer->path, strerror(buffer->error));
+        atomic_fetch_add(&g_num_errors, 1);
+        return;
+    }
+
+    job_t *job = calloc(1, sizeof(job_t));
+    assert(job != NULL);
+    job->path = malloc(strlen(buffer->path) + 1);
+    assert(job->path != NULL);
+    strcpy(job->path, buffer->path);
+    // take the buffer over from the loader
+    job->data = buffer->data;
+    job->size = buffer->size;
+    buffer->data = NULL;
+
+    atomic_fetch_add(&stage->items, 1);
+    atomic_fetch_add(&stage->bytes, job->size);
+    hand_off(stage, job);
+}
+
+static void *read_worker(void *arg) {
+    stage_t *stage = (stage_t *) arg;
+    uint64_t start = now_ns();
+    load_files(g_paths, g_num_paths, g_io_depth, enqueue_loaded_file, stage);
+    // time spent blocked on the parse queue is not read time
+    atomic_fetch_add(&stage->busy_ns, now_ns() - start - atomic_load(&stage->blocked_ns));
+    stage_finish_worker(stage);
+    return NULL;
+}
+
+static job_t *parse_job(stage_t *stage, job_t *job) {
+    job->song = parse_buffer(job->path, job->data, job->size);
+    atomic_fetch_add(&stage->bytes, job->size);
+    if (job->song == NULL) {
+        fprintf(stderr, "Warning: '%s' is not a valid MIDI file\n", job->path);
+        atomic_fetch_add(&g_num_errors, 1);
+        free_job(job);
+        return NULL;
+    }
+    free(job->data);
+    job->data = NULL;
+    return job;
+}
+
+static job_t *transform_job(stage_t *stage, job_t *job) {
+    (void) stage;
+    for (int i = 0; i < g_num_transforms; i++) {
+        transform_t *transform = &g_transforms[i];
+        remapping_t mapping;
+        switch (transform->kind) {
+            case TRANSFORM_OCTAVE:
+                change_octave(job->song, transform->octaves);
+                break;
+            case TRANSFORM_WARP_TIME:
+                warp_time(job->song, transform->multiplier);
+                break;
+            case TRANSFORM_WARP_TEMPO:
+                warp_tempo(job->song, transform->multiplier);
+                break;
+            case TRANSFORM_INSTRUMENT:
+            case TRANSFORM_NOTE:
+                for (int j = 0; j < 128; j++) {
+                    mapping[j] = -1;
+                }
+                mapping[transform->from] = transform->to;
+                if (transform->kind == TRANSFORM_INSTRUMENT) {
+                    remap_instruments(job->song, mapping);
+                } else {
+                    remap_notes(job->song, mapping);
+                }
+                break;
+        }
+    }
+    return job;
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return (slash == NULL) ? path : slash + 1;
+}
+
+static int compare_base_names(const void *a, const void *b) {
+    return strcmp(base_name(*(const char * const *) a), base_name(*(const char * const *) b));
+}
+
+/*
+ * Every output file is named after its input's base name, so two inputs
+ * with the same base name would overwrite each other. Returns the first
+ * such path, or NULL if the base names are all distinct.
+ */
+static const char *find_duplicate_base_name(const char **paths, int num_paths) {
+    const char **sorted = malloc(num_paths * sizeof(const char *));
+    assert(sorted != NULL);
+    memcpy(sorted, paths, num_paths * sizeof(const char *));
+    qsort(sorted, num_paths, sizeof(const char *), compare_base_names);
+
+    const char *duplicate = NULL;
+    for (int i = 1; i < num_paths && duplicate == NULL; i++) {
+        if (compare_base_names(&sorted[i - 1], &sorted[i]) == 0) {
+            duplicate = sorted[i];
+        }
+    }
+    free(sorted);
+    return duplicate;
+}
+
+static job_t *write_job(stage_t *stage, job_t *job) {
+    char output_path[PATH_MAX];
+    snprintf(output_path, sizeof(output_path), "%s/%s", g_output_dir, base_name(job->path));
+
+    size_t size = 0;
+    if (write_song_data(job->song, output_path, &size) != 0) {
+        perror(output_path);
+        atomic_fetch_add(&g_num_errors, 1);
+        free_job(job);
+        return NULL;
+    }
+    atomic_fetch_add(&stage->bytes, size);
+    return job;
+}
+
+static void start_stage(stage_t *stage, void *(*worker)(void *)) {
+    stage->threads = malloc(stage->num_workers * sizeof(pthread_t));
+    assert(stage->threads != NULL);
+    stage->start_ns = now_ns();
+    for (int i = 0; i < stage->num_workers; i++) {
+        int result = pthread_create(&stage->threads[i], NULL, worker, stage);
+        assert(result == 0);
+    }
+}
+
+static void join_stage(stage_t *stage) {
+    for (int i = 0; i < stage->num_workers; i++) {
+        pthread_join(stage->threads[i], NULL);
+    }
+    free(stage->threads);
+}
+
+static void print_stage_stats(stage_t *stage) {
+    double wall_s = (double) (atomic_load(&stage->end_ns) - stage->start_ns) / 1e9;
+    double busy_s = (double) atomic_load(&stage->busy_ns) / 1e9;
+    double blocked_s = (double) atomic_load(&stage->blocked_ns) / 1e9;
+    unsigned long long items = atomic_load(&stage->items);
+    double megabytes = (double) atomic_load(&stage->bytes) / (1024.0 * 1024.0);
+    fprintf(stderr, "%-9s %3d workers %8llu files %9.1f files/s %8.1f MB/s %6.1f%% busy %8.3fs blocked\n",
+            stage->name, stage->num_workers, items,
+            wall_s > 0 ? items / wall_s : 0.0, wall_s > 0 ? megabytes / wall_s : 0.0,
+            wall_s > 0 ? 100.0 * busy_s / (wall_s * stage->num_workers) : 0.0, blocked_s);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options] OUTPUT_DIR FILE...\n"
+            "\n"
+            "Transforms, applied in the order given:\n"
+            "  --octave N            shift notes by N octaves\n"
+            "  --warp F              multiply every delta time by F\n"
+            "  --tempo F             make the song F times as long by rescaling its tempo\n"
+            "  --instrument FROM:TO  change program FROM to TO\n"
+            "  --note FROM:TO        change note FROM to TO\n"
+            "\n"
+            "Pipeline:\n"
+            "  --io-depth N          file reads kept in flight (default %d)\n"
+            "  --parse-workers N     parser threads (default 1)\n"
+            "  --transform-workers N transform threads (default 1)\n"
+            "  --write-workers N     serialize and write threads (default 1)\n"
+            "  --queue N             capacity of each queue between stages (default %d)\n",
+            program, DEFAULT_IO_DEPTH, DEFAULT_QUEUE_CAPACITY);
+}
+
+static int parse_positive(const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end != '\0' || value <= 0 || value > 4096) {
+        return -1;
+    }
+    return (int) value;
+}
+
+/*
+ * Parse a FROM:TO pair of values between 0 and 127. Returns 0 on success.
+ */
+static int parse_pair(const char *arg, transform_t *transform) {
+    int from, to;
+    char extra;
+    if (sscanf(arg, "%d:%d%c", &from, &to, &extra) != 2 ||
+        from < 0 || from > 127 || to < 0 || to > 127) {
+        return -1;
+    }
+    transform->from = from;
+    transform->to = to;
+    return 0;
+}
+
+static void add_transform(transform_t transform) {
+    g_transforms = realloc(g_transforms, (g_num_transforms + 1) * sizeof(transform_t));
+    assert(g_transforms != NULL);
+    g_transforms[g_num_transforms++] = transform;
+}
+
+int main(int argc, char **argv) {
+    enum {
+        OPT_OCTAVE = 256, OPT_WARP, OPT_TEMPO, OPT_INSTRUMENT, OPT_NOTE,
+        OPT_IO_DEPTH, OPT_PARSE_WORKERS, OPT_TRANSFORM_WORKERS, OPT_WRITE_WORKERS, OPT_QUEUE
+    };
+    static const struct option options[] = {
+        { "octave", required_argument, NULL, OPT_OCTAVE },
+        { "warp", required_argument, NULL, OPT_WARP },
+        { "tempo", required_argument, NULL, OPT_TEMPO },
+        { "instrument", required_argument, NULL, OPT_INSTRUMENT },
+        { "note", required_argument, NULL, OPT_NOTE },
+        { "io-depth", required_argument, NULL, OPT_IO_DEPTH },
+        { "parse-workers", required_argument, NULL, OPT_PARSE_WORKERS },
+        { "transform-workers", required_argument, NULL, OPT_TRANSFORM_WORKERS },
+        { "write-workers", required_argument, NULL, OPT_WRITE_WORKERS },
+        { "queue", required_argument, NULL, OPT_QUEUE },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int parse_workers = 1;
+    int transform_workers = 1;
+    int write_workers = 1;
+    int queue_capacity = DEFAULT_QUEUE_CAPACITY;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        transform_t transform = { 0 };
+        int *count = NULL;
+        switch (opt) {
+            case OPT_OCTAVE:
+                transform.kind = TRANSFORM_OCTAVE;
+                transform.octaves = atoi(optarg);
+                add_transform(transform);
+                break;
+            case OPT_WARP:
+            case OPT_TEMPO:
+                transform.kind = (opt == OPT_WARP) ? TRANSFORM_WARP_TIME : TRANSFORM_WARP_TEMPO;
+                transform.multiplier = strtof(optarg, NULL);
+                if (transform.multiplier <= 0) {
+                    fprintf(stderr, "Error: multiplier must be positive: %s\n", optarg);
+                    return 1;
+                }
+                add_transform(transform);
+                break;
+            case OPT_INSTRUMENT:
+            case OPT_NOTE:
+                transform.kind = (opt == OPT_INSTRUMENT) ? TRANSFORM_INSTRUMENT : TRANSFORM_NOTE;
+                if (parse_pair(optarg, &transform) != 0) {
+                    fprintf(stderr, "Error: expected FROM:TO between 0 and 127: %s\n", optarg);
+                    return 1;
+                }
+                add_transform(transform);
+                break;
+            case OPT_IO_DEPTH:
+                count = &g_io_depth;
+                break;
+            case OPT_PARSE_WORKERS:
+                count = &parse_workers;
+                break;
+            case OPT_TRANSFORM_WORKERS:
+                count = &transform_workers;
+                break;
+            case OPT_WRITE_WORKERS:
+                count = &write_workers;
+                break;
+            case OPT_QUEUE:
+                count = &queue_capacity;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+        if (count != NULL && (*count = parse_positive(optarg)) < 0) {
+            fprintf(stderr, "Error: expected a positive count: %s\n", optarg);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    g_output_dir = argv[optind];
+    g_paths = (const char **) &argv[optind + 1];
+    g_num_paths = argc - optind - 1;
+
+    const char *duplicate = find_duplicate_base_name(g_paths, g_num_paths);
+    if (duplicate != NULL) {
+        fprintf(stderr, "Error: more than one input is named '%s'\n", base_name(duplicate));
+        return 1;
+    }
+
+    stage_t read_stage = { .name = "read", .num_workers = 1 };
+    stage_t parse_stage = { .name = "parse", .num_workers = parse_workers, .process = parse_job };
+    stage_t transform_stage = { .name = "transform", .num_workers = transform_workers, .process = transform_job };
+    stage_t write_stage = { .name = "write", .num_workers = write_workers, .process = write_job };
+
+    bounded_queue_t *parse_queue = new_queue(queue_capacity, read_stage.num_workers);
+    bounded_queue_t *transform_queue = new_queue(queue_capacity, parse_stage.num_workers);
+    bounded_queue_t *write_queue = new_queue(queue_capacity, transform_stage.num_workers);
+
+    read_stage.output = parse_queue;
+    parse_stage.input = parse_queue;
+    parse_stage.output = transform_queue;
+    transform_stage.input = transform_queue;
+    transform_stage.output = write_queue;
+    write_stage.input = write_queue;
+    write_stage.output = NULL;
+
+    uint64_t start = now_ns();
+    start_stage(&write_stage, stage_worker);
+    start_stage(&transform_stage, stage_worker);
+    start_stage(&parse_stage, stage_worker);
+    start_stage(&read_stage, read_worker);
+
+    join_stage(&read_stage);
+    join_stage(&parse_stage);
+    join_stage(&transform_stage);
+    join_stage(&write_stage);
+    double total_s = (double) (now_ns() - start) / 1e9;
+
+    print_stage_stats(&read_stage);
+    print_stage_stats(&parse_stage);
+    print_stage_stats(&transform_stage);
+    print_stage_stats(&write_stage);
+    fprintf(stderr, "%llu of %d files processed in %.3fs\n",
+            (unsigned long long) atomic_load(&write_stage.items), g_num_paths, total_s);
+
+    free_queue(parse_queue);
+    free_queue(transform_queue);
+    free_queue(write_queue);
+    free(g_transforms);
+    return atomic_load(&g_num_errors) == 0 ? 0 : 1;
+}
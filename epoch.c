@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "epoch.h"
+
+/**
+ * This file contains epoch-based memory reclamation, used to let readers walk
+ * shared structures without locks while writers replace parts of them.
+ *
+ * A reader announces the global epoch it saw when it enters a read section
+ * and clears it when it leaves. A writer unlinks memory and retires it with
+ * the current epoch. The global epoch only moves forward once every active
+ * reader has caught up with it, so memory retired in epoch e can no longer
+ * be reachable by any reader once the global epoch reaches e + 2, and is
+ * freed then.
+ *
+ * Each thread claims a reader slot the first time it reads and gives it back
+ * when it exits. Slots come in blocks; when every slot is taken another
+ * block is linked in, so there is no limit on the number of reader threads.
+ * Blocks stay until the domain is freed.
+ */
+
+#define READERS_PER_BLOCK 256
+#define CACHE_LINE 64
+#define INACTIVE 0
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ullong epoch;
+    atomic_bool in_use;
+    int nesting;
+} reader_slot_t;
+
+typedef struct reader_block {
+    reader_slot_t slots[READERS_PER_BLOCK];
+    struct reader_block *_Atomic next;
+} reader_block_t;
+
+typedef struct retired {
+    // freed together; a single pointer is kept in single
+    void **ptrs;
+    int count;
+    void *single;
+    void (*free_func)(void *);
+    uint64_t epoch;
+    struct retired *next;
+} retired_t;
+
+typedef struct {
+    // starts at 1 so INACTIVE never matches a live epoch
+    _Alignas(CACHE_LINE) atomic_ullong global_epoch;
+    reader_block_t readers;
+    pthread_key_t slot_key;
+
+    pthread_mutex_t retire_lock;
+    retired_t *retired;
+} epoch_domain_t;
+
+static void release_slot(void *arg) {
+    reader_slot_t *slot = (reader_slot_t *) arg;
+    atomic_store(&slot->epoch, INACTIVE);
+    slot->nesting = 0;
+    atomic_store(&slot->in_use, false);
+}
+
+static void init_reader_block(reader_block_t *block) {
+    for (int i = 0; i < READERS_PER_BLOCK; i++) {
+        atomic_init(&block->slots[i].epoch, INACTIVE);
+        atomic_init(&block->slots[i].in_use, false);
+        block->slots[i].nesting = 0;
+    }
+    atomic_init(&block->next, NULL);
+}
+
+epoch_domain_t *new_epoch_domain(void) {
+    epoch_domain_t *domain = aligned_alloc(CACHE_LINE, (sizeof(epoch_domain_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    assert(domain != NULL);
+    memset(domain, 0, sizeof(epoch_domain_t));
+
+    atomic_init(&domain->global_epoch, 1);
+    init_reader_block(&domain->readers);
+    int result = pthread_key_create(&domain->slot_key, release_slot);
+    assert(result == 0);
+    pthread_mutex_init(&domain->retire_lock, NULL);
+    domain->retired = NULL;
+    return domain;
+}
+
+static reader_slot_t *get_slot(epoch_domain_t *domain) {
+    reader_slot_t *slot = (reader_slot_t *) pthread_getspecific(domain->slot_key);
+    if (slot != NULL) {
+        return slot;
+    }
+
+    reader_block_t *block = &domain->readers;
+    while (true) {
+        for (int i = 0; i < READERS_PER_BLOCK; i++) {
+            bool expected = false;
+            if (atomic_compare_exchange_strong(&block->slots[i].in_use, &expected, true)) {
+                slot = &block->slots[i];
+                slot->nesting = 0;
+                pthread_setspecific(domain->slot_key, slot);
+                return slot;
+            }
+        }
+
+        reader_block_t *next = atomic_load(&block->next);
+        if (next == NULL) {
+            // every slot is taken, link in another block unless a thread
+            // racing with this one already did
+            reader_block_t *grown = aligned_alloc(CACHE_LINE, sizeof(reader_block_t));
+            assert(grown != NULL);
+            init_reader_block(grown);
+            if (atomic_compare_exchange_strong(&block->next, &next, grown)) {
+                next = grown;
+            } else {
+                free(grown);
+            }
+        }
+        block = next;
+    }
+}
+
+/*
+ * Start a read section. Pointers loaded from the protected structure stay
+ * valid until the matching epoch_exit. Sections may nest.
+ */
+void epoch_enter(epoch_domain_t *domain) {
+    reader_slot_t *slot = get_slot(domain);
+    if (slot->nesting++ > 0) {
+        return;
+    }
+    atomic_store_explicit(&slot->epoch, atomic_load(&domain->global_epoch), memory_order_relaxed);
+    // pairs with the fence in try_advance: either the writer's scan sees this
+    // announcement, or the loads below see everything the writer unlinked
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(epoch_domain_t *domain) {
+    reader_slot_t *slot = get_slot(domain);
+    assert(slot->nesting > 0);
+    if (--slot->nesting > 0) {
+        return;
+    }
+    atomic_store_explicit(&slot->epoch, INACTIVE, memory_order_release);
+}
+
+/*
+ * Move the global epoch forward if every active reader has seen the
+ * current one. Returns the global epoch after the attempt.
+ */
+static uint64_t try_advance(epoch_domain_t *domain) {
+    uint64_t global = atomic_load(&domain->global_epoch);
+    // pairs with the fence in epoch_enter, so a reader that announced itself
+    // before the unlinking stores is seen by the scan
+    atomic_thread_fence(memory_order_seq_cst);
+    for (reader_block_t *block = &domain->readers; block != NULL; block = atomic_load(&block->next)) {
+        for (int i = 0; i < READERS_PER_BLOCK; i++) {
+            uint64_t epoch = atomic_load(&block->slots[i].epoch);
+            if (epoch != INACTIVE && epoch != global) {
+                return global;
+            }
+        }
+    }
+    atomic_compare_exchange_strong(&domain->global_epoch, &global, global + 1);
+    return atomic_load(&domain->global_epoch);
+}
+
+/*
+ * Free everything retired at least two epochs ago. Call with retire_lock held.
+ */
+static void reclaim(epoch_domain_t *domain, uint64_t global) {
+    retired_t **link = &domain->retired;
+    while (*link != NULL) {
+        retired_t *entry = *link;
+        if (entry->epoch + 2 <= global) {
+            *link = entry->next;
+            for (int i = 0; i < entry->count; i++) {
+                entry->free_func(entry->ptrs[i]);
+            }
+            if (entry->ptrs != &entry->single) {
+                free(entry->ptrs);
+            }
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+static void retire_entry(epoch_domain_t *domain, retired_t *entry) {
+    pthread_mutex_lock(&domain->retire_lock);
+    entry->epoch = atomic_load(&domain->global_epoch);
+    entry->next = domain->retired;
+    domain->retired = entry;
+    reclaim(domain, try_advance(domain));
+    pthread_mutex_unlock(&domain->retire_lock);
+}
+
+/*
+ * Hand memory that is no longer reachable from the shared structure to the
+ * domain. free_func(ptr) runs once no reader can still be using it.
+ */
+void epoch_retire(epoch_domain_t *domain, void *ptr, void (*free_func)(void *)) {
+    retired_t *entry = malloc(sizeof(retired_t));
+    assert(entry != NULL);
+    entry->single = ptr;
+    entry->ptrs = &entry->single;
+    entry->count = 1;
+    entry->free_func = free_func;
+    retire_entry(domain, entry);
+}
+
+/*
+ * Retire count pointers at once, as if by epoch_retire on each, but taking
+ * the lock and scanning the readers only once. The domain takes ownership
+ * of the malloc'ed ptrs array.
+ */
+void epoch_retire_batch(epoch_domain_t *domain, void **ptrs, int count, void (*free_func)(void *)) {
+    if (count == 0) {
+        free(ptrs);
+        return;
+    }
+    retired_t *entry = malloc(sizeof(retired_t));
+    assert(entry != NULL);
+    entry->ptrs = ptrs;
+    entry->count = count;
+    entry->free_func = free_func;
+    retire_entry(domain, entry);
+}
+
+/*
+ * Wait until everything retired so far has been freed. Must not be called
+ * from inside a read section.
+ */
+void epoch_synchronize(epoch_domain_t *domain) {
+    pthread_mutex_lock(&domain->retire_lock);
+    uint64_t target = atomic_load(&domain->global_epoch) + 2;
+    uint64_t global;
+    while ((global = try_advance(domain)) < target) {
+        pthread_mutex_unlock(&domain->retire_lock);
+        sched_yield();
+        pthread_mutex_lock(&domain->retire_lock);
+    }
+    reclaim(domain, global);
+    pthread_mutex_unlock(&domain->retire_lock);
+}
+
+void free_epoch_domain(epoch_domain_t *domain) {
+    if (domain == NULL) {
+        return;
+    }
+    epoch_synchronize(domain);
+    assert(domain->retired == NULL);
+    pthread_key_delete(domain->slot_key);
+    pthread_mutex_destroy(&domain->retire_lock);
+    reader_block_t *block = atomic_load(&domain->readers.next);
+    while (block != NULL) {
+        reader_block_t *next = atomic_load(&block->next);
+        free(block);
+        block = next;
+    }
+    free(domain);
+}
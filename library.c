@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,12 @@
 #include <ftw.h>
 #include "library.h"
 #include "midi.h"
+#include "similarity.h"
+#include "loader.h"
+#include "parser.h"
+#include "summary.h"
+#include "epoch.h"
+#include "song_cache.h"
 
 /**
  * This file contains functions for managing a library of MIDI songs.
@@ -16,6 +23,18 @@
  */
 typedef void (*traversal_func_t)(tree_node_t *, void *);
 
+/*
+ * Similarity index kept in step with g_song_library, NULL when not wanted.
+ * Create it with new_similarity_index(library_epoch()).
+ */
+similarity_index_t *g_similarity_index = NULL;
+
+/*
+ * Cache holding the parsed tracks of library songs, NULL to keep every song
+ * fully parsed. When set, songs must be read through song_cache_acquire.
+ */
+song_cache_t *g_song_cache = NULL;
+
 tree_node_t **find_parent_pointer(tree_node_t **root, char *song_name) {
     if (*root == NULL || strcmp((*root)->song->song_name, song_name) == 0) {
         return root;
@@ -164,6 +183,15 @@ void print_node(tree_node_t *node, FILE *fp) {
     fprintf(fp, "%s\n", node->song->song_name);
 }
 
+/*
+ * Like print_node, but also prints the song's summary. Uses only the
+ * summary kept with the song, so no events are walked.
+ */
+void print_node_summary(tree_node_t *node, FILE *fp) {
+    fprintf(fp, "%s: ", node->song->song_name);
+    print_summary(&node->song->summary, fp);
+}
+
 void free_library(tree_node_t *root) {
     if (root == NULL) {
         return;
@@ -172,8 +200,368 @@ void free_library(tree_node_t *root) {
     free_library(root->right_child);
     free_node(root);
 }
-void make_library(const char *dir_name) {
-    assert(dir_name != NULL);
+/*
+ * Concurrent access to g_song_library.
+ *
+ * Readers bracket their work with library_read_lock and library_read_unlock
+ * and never block. Writers are serialized on a mutex and never modify a node
+ * a reader can see: they copy the path from the root to the change, publish
+ * the new root with a single atomic store, and retire the replaced nodes
+ * (and any removed song) through the epoch domain. That memory is freed
+ * only once every reader that could have seen it has left its read section.
+ *
+ * g_similarity_index shares the scheme: it is only changed under the same
+ * mutex, alongside the tree, and its readers are protected by the same
+ * epoch domain.
+ *
+ * tree_insert and remove_song_from_tree still modify the tree in place and
+ * must not be used while readers are active.
+ */
+static epoch_domain_t *g_library_epoch = NULL;
+static pthread_once_t g_library_epoch_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_library_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_library_epoch(void) {
+    g_library_epoch = new_epoch_domain();
+}
+
+/*
+ * The epoch domain protecting readers of g_song_library. Pass it to
+ * new_similarity_index.
+ */
+epoch_domain_t *library_epoch(void) {
+    pthread_once(&g_library_epoch_once, init_library_epoch);
+    return g_library_epoch;
+}
+
+void library_read_lock(void) {
+    epoch_enter(library_epoch());
+}
+
+void library_read_unlock(void) {
+    epoch_exit(library_epoch());
+}
+
+static void free_song_memory(void *song) {
+    if (g_song_cache != NULL) {
+        song_cache_forget(g_song_cache, (song_data_t *) song);
+    }
+    free_song((song_data_t *) song);
+}
+
+typedef struct {
+    void **nodes;
+    int count;
+    int capacity;
+} retire_list_t;
+
+static void retire_later(retire_list_t *list, tree_node_t *node) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 32;
+        list->nodes = realloc(list->nodes, list->capacity * sizeof(void *));
+        assert(list->nodes != NULL);
+    }
+    list->nodes[list->count++] = node;
+}
+
+/*
+ * Retire the replaced nodes as one batch. Only the node structs are freed,
+ * their songs and children live on in the new tree.
+ */
+static void retire_nodes(retire_list_t *list) {
+    epoch_retire_batch(library_epoch(), list->nodes, list->count, free);
+}
+
+static tree_node_t *copy_node(tree_node_t *node, retire_list_t *retired) {
+    tree_node_t *copy = malloc(sizeof(tree_node_t));
+    assert(copy != NULL);
+    *copy = *node;
+    retire_later(retired, node);
+    return copy;
+}
+
+static tree_node_t *insert_copy(tree_node_t *root, tree_node_t *node, int *result, retire_list_t *retired) {
+    if (root == NULL) {
+        *result = INSERT_SUCCESS;
+        return node;
+    }
+
+    int cmp = strcmp(node->song_name, root->song_name);
+    if (cmp == 0) {
+        *result = DUPLICATE_SONG;
+        return root;
+    }
+
+    tree_node_t *child = insert_copy((cmp < 0) ? root->left_child : root->right_child, node, result, retired);
+    if (*result != INSERT_SUCCESS) {
+        return root;
+    }
+    tree_node_t *copy = copy_node(root, retired);
+    if (cmp < 0) {
+        copy->left_child = child;
+    } else {
+        copy->right_child = child;
+    }
+    return copy;
+}
+
+/*
+ * Unlink the smallest node of a non-empty subtree. It is returned through
+ * min_node, and is retired like the copied nodes.
+ */
+static tree_node_t *remove_min_copy(tree_node_t *root, tree_node_t **min_node, retire_list_t *retired) {
+    if (root->left_child == NULL) {
+        *min_node = root;
+        retire_later(retired, root);
+        return root->right_child;
+    }
+    tree_node_t *left = remove_min_copy(root->left_child, min_node, retired);
+    tree_node_t *copy = copy_node(root, retired);
+    copy->left_child = left;
+    return copy;
+}
+
+static tree_node_t *remove_copy(tree_node_t *root, const char *song_name, song_data_t **removed,
+                                retire_list_t *retired) {
+    if (root == NULL) {
+        return NULL;
+    }
+
+    int cmp = strcmp(song_name, root->song_name);
+    if (cmp != 0) {
+        tree_node_t *child = remove_copy((cmp < 0) ? root->left_child : root->right_child, song_name, removed, retired);
+        if (*removed == NULL) {
+            return root;
+        }
+        tree_node_t *copy = copy_node(root, retired);
+        if (cmp < 0) {
+            copy->left_child = child;
+        } else {
+            copy->right_child = child;
+        }
+        return copy;
+    }
+
+    *removed = root->song;
+    retire_later(retired, root);
+    if (root->left_child == NULL) {
+        return root->right_child;
+    }
+    if (root->right_child == NULL) {
+        return root->left_child;
+    }
+
+    // two children, the in-order successor takes the removed node's place
+    tree_node_t *successor = NULL;
+    tree_node_t *right = remove_min_copy(root->right_child, &successor, retired);
+    tree_node_t *copy = malloc(sizeof(tree_node_t));
+    assert(copy != NULL);
+    *copy = *successor;
+    copy->left_child = root->left_child;
+    copy->right_child = right;
+    return copy;
+}
+
+/*
+ * Insert node into g_song_library, and its song into g_similarity_index,
+ * while readers may be walking them. Returns INSERT_SUCCESS or
+ * DUPLICATE_SONG. On DUPLICATE_SONG the node is left to the caller.
+ */
+int library_insert(tree_node_t *node) {
+    assert(node != NULL);
+    node->left_child = NULL;
+    node->right_child = NULL;
+
+    retire_list_t retired = { NULL, 0, 0 };
+    int result = DUPLICATE_SONG;
+
+    pthread_mutex_lock(&g_library_write_lock);
+    tree_node_t *root = __atomic_load_n(&g_song_library, __ATOMIC_ACQUIRE);
+    tree_node_t *new_root = insert_copy(root, node, &result, &retired);
+    if (result == INSERT_SUCCESS) {
+        __atomic_store_n(&g_song_library, new_root, __ATOMIC_RELEASE);
+        if (g_similarity_index != NULL) {
+            similarity_index_add(g_similarity_index, node->song);
+        }
+    }
+    pthread_mutex_unlock(&g_library_write_lock);
+
+    retire_nodes(&retired);
+    return result;
+}
+
+/*
+ * Remove the named song from g_song_library and g_similarity_index while
+ * readers may be walking them. The song is freed once no reader can still
+ * hold it.
+ * Returns DELETE_SUCCESS or SONG_NOT_FOUND.
+ */
+int library_remove(const char *song_name) {
+    assert(song_name != NULL);
+    retire_list_t retired = { NULL, 0, 0 };
+    song_data_t *removed = NULL;
+
+    pthread_mutex_lock(&g_library_write_lock);
+    tree_node_t *root = __atomic_load_n(&g_song_library, __ATOMIC_ACQUIRE);
+    tree_node_t *new_root = remove_copy(root, song_name, &removed, &retired);
+    if (removed != NULL) {
+        __atomic_store_n(&g_song_library, new_root, __ATOMIC_RELEASE);
+        if (g_similarity_index != NULL) {
+            similarity_index_remove(g_similarity_index, removed);
+        }
+    }
+    pthread_mutex_unlock(&g_library_write_lock);
+
+    if (removed == NULL) {
+        // not found, so nothing was copied
+        free(retired.nodes);
+        return SONG_NOT_FOUND;
+    }
+    retire_nodes(&retired);
+    epoch_retire(library_epoch(), removed, free_song_memory);
+    return DELETE_SUCCESS;
+}
+
+/*
+ * Look up a song by name. Must be called inside a read section, and the
+ * returned song is only valid until library_read_unlock.
+ */
+song_data_t *library_find(const char *song_name) {
+    tree_node_t *node = __atomic_load_n(&g_song_library, __ATOMIC_ACQUIRE);
+    while (node != NULL) {
+        int cmp = strcmp(song_name, node->song_name);
+        if (cmp == 0) {
+            return node->song;
+        }
+        node = (cmp < 0) ? node->left_child : node->right_child;
+    }
+    return NULL;
+}
+
+/*
+ * In-order traversal of a consistent snapshot of g_song_library.
+ */
+void library_traverse_in_order(void *data, traversal_func_t func) {
+    library_read_lock();
+    traverse_in_order(__atomic_load_n(&g_song_library, __ATOMIC_ACQUIRE), data, func);
+    library_read_unlock();
+}
+
+
+static void set_song_name(song_data_t *song, const char *song_name) {
+    song->song_name = malloc(strlen(song_name) + 1);
+    assert(song->song_name != NULL);
+    strcpy(song->song_name, song_name);
+}
+
+typedef struct {
+    song_data_t *song;
+    tree_node_t *node;
+    // taken while the tracks were loaded, NULL without a similarity index
+    similarity_fingerprint_t *fingerprint;
+} pending_song_t;
+
+/*
+ * Songs loaded but not yet published. The tree only catches duplicates
+ * within the batch and no reader can see it; songs lists them in load order.
+ */
+typedef struct {
+    tree_node_t *root;
+    pending_song_t *songs;
+    int count;
+    int capacity;
+} private_library_t;
+
+static void drop_duplicate(song_data_t *song) {
+    fprintf(stderr, "Warning: duplicate song '%s' found in library\n", song->song_name);
+    free_song_memory(song);
+}
+
+/*
+ * Add a freshly loaded song to the private library. Its fingerprint is taken
+ * and it is handed to the song cache right away, so its tracks can be
+ * evicted long before the library is published and loading never needs
+ * memory for the whole corpus. Duplicates are reported and freed.
+ */
+static void add_song_to_tree(private_library_t *library, song_data_t *song, const char *song_name) {
+    set_song_name(song, song_name);
+    tree_node_t *node = new_tree_node(song);
+    if (tree_insert(&library->root, node) == DUPLICATE_SONG) {
+        drop_duplicate(song);
+        free(node);
+        return;
+    }
+
+    if (library->count == library->capacity) {
+        library->capacity = library->capacity ? library->capacity * 2 : 64;
+        library->songs = realloc(library->songs, library->capacity * sizeof(pending_song_t));
+        assert(library->songs != NULL);
+    }
+    pending_song_t *pending = &library->songs[library->count++];
+    pending->song = song;
+    pending->node = node;
+    pending->fingerprint = (g_similarity_index != NULL) ? similarity_fingerprint(song) : NULL;
+
+    // from here on only the name, filename and summary are sure to stay
+    if (g_song_cache != NULL) {
+        song_cache_admit(g_song_cache, song);
+    }
+}
+
+/*
+ * Publish a privately built library. Into an empty library the private tree
+ * is published as is with one store. Otherwise its nodes are merged in, in
+ * load order, with insert_copy. The private tree was built in that same
+ * order, so the merge keeps roughly its shape. The new root is still
+ * published once, and every replaced node is retired as one batch. The new
+ * songs are added to the similarity index under the same lock, from the
+ * fingerprints taken at load time.
+ *
+ * A node merged early can be copied, and so retired, by a later insert_copy,
+ * so only the pending songs are used once merging starts, never the nodes.
+ */
+static void publish_library(private_library_t *private_library) {
+    retire_list_t retired = { NULL, 0, 0 };
+
+    pthread_mutex_lock(&g_library_write_lock);
+    tree_node_t *library = __atomic_load_n(&g_song_library, __ATOMIC_ACQUIRE);
+    int num_added = 0;
+    if (library == NULL) {
+        library = private_library->root;
+        num_added = private_library->count;
+    } else {
+        for (int i = 0; i < private_library->count; i++) {
+            pending_song_t *pending = &private_library->songs[i];
+            pending->node->left_child = NULL;
+            pending->node->right_child = NULL;
+            int result = DUPLICATE_SONG;
+            library = insert_copy(library, pending->node, &result, &retired);
+            if (result == DUPLICATE_SONG) {
+                drop_duplicate(pending->song);
+                free(pending->node);
+                free_similarity_fingerprint(pending->fingerprint);
+            } else {
+                private_library->songs[num_added++] = *pending;
+            }
+        }
+    }
+    __atomic_store_n(&g_song_library, library, __ATOMIC_RELEASE);
+    for (int i = 0; i < num_added; i++) {
+        pending_song_t *pending = &private_library->songs[i];
+        if (pending->fingerprint != NULL) {
+            similarity_index_add_fingerprint(g_similarity_index, pending->song, pending->fingerprint);
+        }
+    }
+    pthread_mutex_unlock(&g_library_write_lock);
+
+    retire_nodes(&retired);
+    for (int i = 0; i < num_added; i++) {
+        free_similarity_fingerprint(private_library->songs[i].fingerprint);
+    }
+    free(private_library->songs);
+}
+
+static void build_library(const char *dir_name, private_library_t *library) {
     DIR *dir;
     struct dirent *ent;
     if ((dir = opendir(dir_name)) != NULL) {
@@ -181,10 +569,10 @@ void make_library(const char *dir_name) {
         while ((ent = readdir(dir)) != NULL) {
             /* Check if the entry is a directory and not "." or ".." */
             if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-                /* Recursively call make_library on the subdirectory */
+                /* Recursively build the library from the subdirectory */
                 char sub_dir_name[PATH_MAX];
                 snprintf(sub_dir_name, sizeof(sub_dir_name), "%s/%s", dir_name, ent->d_name);
-                make_library(sub_dir_name);
+                build_library(sub_dir_name, library);
             }
             /* Check if the entry is a file and has a ".mid" extension */
             else if (ent->d_type == DT_REG && strstr(ent->d_name, ".mid") != NULL) {
@@ -195,15 +583,15 @@ void make_library(const char *dir_name) {
                 } else {
                     song_name++;
                 }
-                /* Create a new song and add it to the library */
+                /* Parse the song and add it to the library */
                 char full_path[PATH_MAX];
                 snprintf(full_path, sizeof(full_path), "%s/%s", dir_name, ent->d_name);
-                song_t *song = new_song(song_name, full_path);
-                int insert_result = tree_insert(&g_song_library, new_tree_node(song));
-                if (insert_result == DUPLICATE_SONG) {
-                    fprintf(stderr, "Warning: duplicate song '%s' found in library\n", song_name);
-                    free_song(song);
+                song_data_t *song = parse_file(full_path);
+                if (song == NULL) {
+                    fprintf(stderr, "Warning: '%s' is not a valid MIDI file\n", full_path);
+                    continue;
                 }
+                add_song_to_tree(library, song, song_name);
             }
         }
         closedir(dir);
@@ -213,3 +601,93 @@ void make_library(const char *dir_name) {
     }
 }
 
+/*
+ * Load every ".mid" file under dir_name into g_song_library. The songs are
+ * gathered into a private library first and published in one step, so
+ * readers never see a partly loaded directory.
+ */
+void make_library(const char *dir_name) {
+    assert(dir_name != NULL);
+    private_library_t library = { NULL, NULL, 0, 0 };
+    build_library(dir_name, &library);
+    publish_library(&library);
+}
+
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} path_list_t;
+
+/*
+ * Walk dir_name the same way make_library does and collect the path of
+ * every ".mid" file found.
+ */
+static void collect_midi_paths(const char *dir_name, path_list_t *list) {
+    DIR *dir = opendir(dir_name);
+    if (dir == NULL) {
+        perror("make_library_async opendir");
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        char full_path[PATH_MAX];
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_name, ent->d_name);
+        if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            collect_midi_paths(full_path, list);
+        } else if (ent->d_type == DT_REG && strstr(ent->d_name, ".mid") != NULL) {
+            if (list->count == list->capacity) {
+                list->capacity = list->capacity ? list->capacity * 2 : 64;
+                list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+                assert(list->paths != NULL);
+            }
+            list->paths[list->count] = malloc(strlen(full_path) + 1);
+            assert(list->paths[list->count] != NULL);
+            strcpy(list->paths[list->count], full_path);
+            list->count++;
+        }
+    }
+    closedir(dir);
+}
+
+static void add_loaded_song(file_buffer_t *buffer, void *data) {
+    private_library_t *library = (private_library_t *) data;
+    if (buffer->error != 0) {
+        fprintf(stderr, "Warning: could not read '%s': %s\n", buffer->path, strerror(buffer->error));
+        return;
+    }
+
+    const char *song_name = strrchr(buffer->path, '/');
+    song_name = (song_name == NULL) ? buffer->path : song_name + 1;
+
+    song_data_t *song = parse_buffer(buffer->path, buffer->data, buffer->size);
+    if (song == NULL) {
+        fprintf(stderr, "Warning: '%s' is not a valid MIDI file\n", buffer->path);
+        return;
+    }
+    add_song_to_tree(library, song, song_name);
+}
+
+/*
+ * Same as make_library, but the files are read through the asynchronous
+ * loader with up to queue_depth reads in flight. Songs are parsed and
+ * added to the private library on the calling thread as their reads
+ * complete, so insertion order follows completion order rather than
+ * directory order.
+ */
+void make_library_async(const char *dir_name, int queue_depth) {
+    assert(dir_name != NULL);
+
+    path_list_t list = { NULL, 0, 0 };
+    collect_midi_paths(dir_name, &list);
+
+    private_library_t library = { NULL, NULL, 0, 0 };
+    load_files((const char **) list.paths, list.count, queue_depth, add_loaded_song, &library);
+    publish_library(&library);
+
+    for (int i = 0; i < list.count; i++) {
+        free(list.paths[i]);
+    }
+    free(list.paths);
+}
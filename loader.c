@@ -0,0 +1,385 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <linux/stat.h>
+#endif
+#include "loader.h"
+
+/**
+ * This file contains an asynchronous file loader used to ingest the song
+ * library. Many reads are kept in flight at once so that loading a cold or
+ * network-backed library is not serialized on the latency of each file.
+ *
+ * On Linux builds with HAVE_LIBURING defined the opens, stats and reads all
+ * go through io_uring, so even the metadata lookups of many files overlap.
+ * Otherwise, or when the kernel refuses to set up a ring, a pool of threads
+ * doing pread is used instead. Either way the callback is always invoked on
+ * the thread that called load_files, one buffer at a time, so it may touch
+ * the library without any locking.
+ */
+
+#define DEFAULT_QUEUE_DEPTH 32
+
+typedef struct {
+    const char *path;
+    uint8_t *data;
+    size_t size;
+    int error;
+} file_buffer_t;
+
+typedef void (*file_loaded_func_t)(file_buffer_t *, void *);
+
+/*
+ * Hand a finished buffer to the callback. The callback may keep the data by
+ * setting buffer->data to NULL, otherwise it is freed here.
+ */
+static void deliver_buffer(file_buffer_t *buffer, file_loaded_func_t func, void *data) {
+    func(buffer, data);
+    free(buffer->data);
+    buffer->data = NULL;
+}
+
+/*
+ * Allocate a buffer for the whole file once buffer->size is known. Returns
+ * false with buffer->error set if there is no memory.
+ */
+static bool allocate_buffer(file_buffer_t *buffer) {
+    // keep a valid pointer for empty files
+    buffer->data = malloc(buffer->size ? buffer->size : 1);
+    if (buffer->data == NULL) {
+        buffer->error = ENOMEM;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Open the file and allocate a buffer for its whole contents. Returns the
+ * file descriptor, or -1 with buffer->error set.
+ */
+static int open_buffer(file_buffer_t *buffer) {
+    int fd = open(buffer->path, O_RDONLY);
+    if (fd < 0) {
+        buffer->error = errno;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        buffer->error = errno;
+        close(fd);
+        return -1;
+    }
+
+    buffer->size = (size_t) st.st_size;
+    if (!allocate_buffer(buffer)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Read a whole file with pread, retrying on short reads.
+ */
+static void read_whole_file(file_buffer_t *buffer) {
+    int fd = open_buffer(buffer);
+    if (fd < 0) {
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < buffer->size) {
+        ssize_t n = pread(fd, buffer->data + offset, buffer->size - offset, (off_t) offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            buffer->error = errno;
+            break;
+        }
+        if (n == 0) {
+            // file shrank while reading
+            buffer->size = offset;
+            break;
+        }
+        offset += (size_t) n;
+    }
+    close(fd);
+}
+
+typedef struct {
+    const char **paths;
+    int num_paths;
+    int next_path;
+
+    // finished buffers waiting for the caller, at most queue_depth of them
+    file_buffer_t *ready;
+    int ready_head;
+    int ready_count;
+    int queue_depth;
+    int num_delivered;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    pthread_cond_t space_cond;
+} pread_pool_t;
+
+static void *pread_worker(void *arg) {
+    pread_pool_t *pool = (pread_pool_t *) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next_path == pool->num_paths) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        int index = pool->next_path++;
+        pthread_mutex_unlock(&pool->lock);
+
+        file_buffer_t buffer = { pool->paths[index], NULL, 0, 0 };
+        read_whole_file(&buffer);
+
+        pthread_mutex_lock(&pool->lock);
+        // backpressure: don't read further ahead than the caller can parse
+        while (pool->ready_count == pool->queue_depth) {
+            pthread_cond_wait(&pool->space_cond, &pool->lock);
+        }
+        int tail = (pool->ready_head + pool->ready_count) % pool->queue_depth;
+        pool->ready[tail] = buffer;
+        pool->ready_count++;
+        pthread_cond_signal(&pool->ready_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static int load_files_pread(const char **paths, int num_paths, int queue_depth,
+                            file_loaded_func_t func, void *data) {
+    pread_pool_t pool;
+    pool.paths = paths;
+    pool.num_paths = num_paths;
+    pool.next_path = 0;
+    pool.ready = malloc(queue_depth * sizeof(file_buffer_t));
+    assert(pool.ready != NULL);
+    pool.ready_head = 0;
+    pool.ready_count = 0;
+    pool.queue_depth = queue_depth;
+    pool.num_delivered = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready_cond, NULL);
+    pthread_cond_init(&pool.space_cond, NULL);
+
+    int num_workers = (queue_depth < num_paths) ? queue_depth : num_paths;
+    pthread_t *workers = malloc(num_workers * sizeof(pthread_t));
+    assert(workers != NULL);
+    for (int i = 0; i < num_workers; i++) {
+        int result = pthread_create(&workers[i], NULL, pread_worker, &pool);
+        assert(result == 0);
+    }
+
+    int num_errors = 0;
+    while (pool.num_delivered < num_paths) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.ready_count == 0) {
+            pthread_cond_wait(&pool.ready_cond, &pool.lock);
+        }
+        file_buffer_t buffer = pool.ready[pool.ready_head];
+        pool.ready_head = (pool.ready_head + 1) % pool.queue_depth;
+        pool.ready_count--;
+        pthread_cond_signal(&pool.space_cond);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (buffer.error != 0) {
+            num_errors++;
+        }
+        deliver_buffer(&buffer, func, data);
+        pool.num_delivered++;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(pool.ready);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.ready_cond);
+    pthread_cond_destroy(&pool.space_cond);
+    return num_errors;
+}
+
+#ifdef HAVE_LIBURING
+enum {
+    URING_OPEN,
+    URING_STATX,
+    URING_READ
+};
+
+// the operation is kept in the low bits of each sqe's user data
+#define URING_OP_MASK 3
+
+typedef struct {
+    file_buffer_t buffer;
+    int fd;
+    size_t offset;
+    // open and statx are queued together, the read waits for both
+    int pending;
+    struct statx stx;
+} uring_request_t;
+
+static void set_request(struct io_uring_sqe *sqe, uring_request_t *request, int op) {
+    io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) request | (uintptr_t) op));
+}
+
+static void submit_op(struct io_uring *ring, uring_request_t *request, int op) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    assert(sqe != NULL);
+    if (op == URING_OPEN) {
+        io_uring_prep_openat(sqe, AT_FDCWD, request->buffer.path, O_RDONLY, 0);
+    } else if (op == URING_STATX) {
+        io_uring_prep_statx(sqe, AT_FDCWD, request->buffer.path, 0, STATX_SIZE, &request->stx);
+    } else {
+        io_uring_prep_read(sqe, request->fd, request->buffer.data + request->offset,
+                           (unsigned) (request->buffer.size - request->offset), request->offset);
+    }
+    set_request(sqe, request, op);
+}
+
+static void finish_request(uring_request_t *request, file_loaded_func_t func, void *data) {
+    if (request->fd >= 0) {
+        close(request->fd);
+    }
+    deliver_buffer(&request->buffer, func, data);
+    free(request);
+}
+
+/*
+ * Record the result of an open or statx. Returns true once both have
+ * completed and the read can be queued.
+ */
+static bool finish_open_op(uring_request_t *request, int op, int res) {
+    if (res < 0) {
+        if (request->buffer.error == 0) {
+            request->buffer.error = -res;
+        }
+    } else if (op == URING_OPEN) {
+        request->fd = res;
+    } else {
+        request->buffer.size = (size_t) request->stx.stx_size;
+    }
+    return --request->pending == 0;
+}
+
+/*
+ * Returns -1 if the ring could not be created, so the caller can fall back
+ * to the thread pool. Otherwise returns the number of failed files.
+ */
+static int load_files_uring(const char **paths, int num_paths, int queue_depth,
+                            file_loaded_func_t func, void *data) {
+    struct io_uring ring;
+    // each file has at most two operations outstanding
+    if (io_uring_queue_init((unsigned) queue_depth * 2, &ring, 0) < 0) {
+        return -1;
+    }
+
+    int next_path = 0;
+    int in_flight = 0;
+    int num_errors = 0;
+
+    while (next_path < num_paths || in_flight > 0) {
+        // top the ring up to queue_depth files in flight
+        while (next_path < num_paths && in_flight < queue_depth) {
+            uring_request_t *request = malloc(sizeof(uring_request_t));
+            assert(request != NULL);
+            request->buffer = (file_buffer_t) { paths[next_path++], NULL, 0, 0 };
+            request->fd = -1;
+            request->offset = 0;
+            request->pending = 2;
+            submit_op(&ring, request, URING_OPEN);
+            submit_op(&ring, request, URING_STATX);
+            in_flight++;
+        }
+        io_uring_submit(&ring);
+
+        struct io_uring_cqe *cqe;
+        int result = io_uring_wait_cqe(&ring, &cqe);
+        if (result == -EINTR) {
+            continue;
+        }
+        assert(result == 0);
+
+        uintptr_t tag = (uintptr_t) io_uring_cqe_get_data(cqe);
+        uring_request_t *request = (uring_request_t *) (tag & ~(uintptr_t) URING_OP_MASK);
+        int op = (int) (tag & URING_OP_MASK);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        if (res == -EINTR || res == -EAGAIN) {
+            submit_op(&ring, request, op);
+            continue;
+        }
+        if (op != URING_READ) {
+            if (!finish_open_op(request, op, res)) {
+                continue;
+            }
+            if (request->buffer.error == 0 && allocate_buffer(&request->buffer)
+                && request->buffer.size > 0) {
+                submit_op(&ring, request, URING_READ);
+                continue;
+            }
+        } else if (res < 0) {
+            request->buffer.error = -res;
+        } else if (res == 0) {
+            // file shrank while reading
+            request->buffer.size = request->offset;
+        } else {
+            request->offset += (size_t) res;
+            if (request->offset < request->buffer.size) {
+                // short read, queue the rest
+                submit_op(&ring, request, URING_READ);
+                continue;
+            }
+        }
+        in_flight--;
+        num_errors += (request->buffer.error != 0);
+        finish_request(request, func, data);
+    }
+
+    io_uring_queue_exit(&ring);
+    return num_errors;
+}
+#endif
+
+/*
+ * Read every file in paths, keeping up to queue_depth reads in flight, and
+ * call func with each buffer as it completes. Buffers are delivered in
+ * completion order, not in the order of paths. A failed read is still
+ * delivered, with buffer->error set to the errno value. Returns the number of
+ * files that failed.
+ */
+int load_files(const char **paths, int num_paths, int queue_depth, file_loaded_func_t func, void *data) {
+    assert(paths != NULL && func != NULL);
+    if (num_paths <= 0) {
+        return 0;
+    }
+    if (queue_depth <= 0) {
+        queue_depth = DEFAULT_QUEUE_DEPTH;
+    }
+
+#ifdef HAVE_LIBURING
+    int num_errors = load_files_uring(paths, num_paths, queue_depth, func, data);
+    if (num_errors >= 0) {
+        return num_errors;
+    }
+#endif
+    return load_files_pread(paths, num_paths, queue_depth, func, data);
+}
@@ -0,0 +1,233 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "notes.h"
+
+/**
+ * This file turns a song's Note On and Note Off events into note spans: one
+ * record per sounding note with its start tick, duration, pitch, velocity,
+ * channel and track. All spans of a song are stored in one contiguous array
+ * (a piano roll).
+ *
+ * Each track is paired in a single pass. For every channel and key there is
+ * a stack of the notes still sounding. Note On pushes, and Note Off (or Note
+ * On with velocity 0) pops the most recent one. The stacks are threaded
+ * through the span array itself, so pairing never allocates per note.
+ * Overlapping notes on the same key are closed last-in first-out, and notes
+ * still sounding when the track ends are closed there.
+ *
+ * Tracks are independent, so build_piano_roll can pair them on several
+ * threads.
+ */
+
+#define NOTE_OFF_STATUS 0x8
+#define NOTE_ON_STATUS 0x9
+#define NO_NOTE -1
+
+typedef struct {
+    uint32_t start_tick;
+    uint32_t duration;
+    uint8_t pitch;
+    uint8_t velocity;
+    uint8_t channel;
+    uint16_t track;
+} note_span_t;
+
+typedef struct {
+    note_span_t *spans;
+    uint32_t count;
+} piano_roll_t;
+
+typedef struct {
+    note_span_t *spans;
+    // for each open span, the span below it on the same channel and key
+    int32_t *below;
+    uint32_t count;
+    uint32_t capacity;
+} span_buffer_t;
+
+static uint32_t append_span(span_buffer_t *buffer) {
+    if (buffer->count == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->spans = realloc(buffer->spans, buffer->capacity * sizeof(note_span_t));
+        buffer->below = realloc(buffer->below, buffer->capacity * sizeof(int32_t));
+        assert(buffer->spans != NULL && buffer->below != NULL);
+    }
+    return buffer->count++;
+}
+
+/*
+ * Pair the notes of one track. Spans come out in order of their start tick.
+ */
+static void pair_track(track_t *track, uint16_t track_index, span_buffer_t *buffer) {
+    int32_t open[16][128];
+    for (int channel = 0; channel < 16; channel++) {
+        for (int key = 0; key < 128; key++) {
+            open[channel][key] = NO_NOTE;
+        }
+    }
+
+    uint32_t tick = 0;
+    for (event_node_t *event_node = track->event_list; event_node != NULL; event_node = event_node->next) {
+        event_t *event = event_node->event;
+        tick += event->delta_time;
+        if (event->type == META_EVENT || event->type == SYS_EVENT_1 || event->type == SYS_EVENT_2) {
+            continue;
+        }
+
+        midi_event_t *midi_event = (midi_event_t *) event->data;
+        uint8_t kind = midi_event->status >> 4;
+        if (kind != NOTE_ON_STATUS && kind != NOTE_OFF_STATUS) {
+            continue;
+        }
+        uint8_t channel = midi_event->status & 0x0F;
+        uint8_t key = midi_event->data[0] & 0x7F;
+        uint8_t velocity = midi_event->data[1] & 0x7F;
+
+        if (kind == NOTE_ON_STATUS && velocity != 0) {
+            uint32_t index = append_span(buffer);
+            note_span_t *span = &buffer->spans[index];
+            span->start_tick = tick;
+            span->duration = 0;
+            span->pitch = key;
+            span->velocity = velocity;
+            span->channel = channel;
+            span->track = track_index;
+            buffer->below[index] = open[channel][key];
+            open[channel][key] = (int32_t) index;
+        } else {
+            // Note Off, or Note On with velocity 0
+            int32_t index = open[channel][key];
+            if (index == NO_NOTE) {
+                // stray Note Off
+                continue;
+            }
+            buffer->spans[index].duration = tick - buffer->spans[index].start_tick;
+            open[channel][key] = buffer->below[index];
+        }
+    }
+
+    // close anything still sounding at the end of the track
+    for (int channel = 0; channel < 16; channel++) {
+        for (int key = 0; key < 128; key++) {
+            for (int32_t index = open[channel][key]; index != NO_NOTE; index = buffer->below[index]) {
+                buffer->spans[index].duration = tick - buffer->spans[index].start_tick;
+            }
+        }
+    }
+}
+
+typedef struct {
+    track_t **tracks;
+    span_buffer_t *buffers;
+    int num_tracks;
+    atomic_int next_track;
+} pairing_job_t;
+
+static void *pairing_worker(void *arg) {
+    pairing_job_t *job = (pairing_job_t *) arg;
+    int i;
+    while ((i = atomic_fetch_add(&job->next_track, 1)) < job->num_tracks) {
+        pair_track(job->tracks[i], (uint16_t) i, &job->buffers[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Build the piano roll of a song using up to num_threads threads. Spans are
+ * grouped by track in track order, and ordered by start tick within each
+ * track; use sort_piano_roll for a single timeline.
+ */
+piano_roll_t *build_piano_roll(song_data_t *song, int num_threads) {
+    assert(song != NULL);
+
+    int num_tracks = 0;
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        num_tracks++;
+    }
+
+    pairing_job_t job;
+    job.tracks = malloc((num_tracks + 1) * sizeof(track_t *));
+    job.buffers = calloc(num_tracks + 1, sizeof(span_buffer_t));
+    assert(job.tracks != NULL && job.buffers != NULL);
+    job.num_tracks = num_tracks;
+    atomic_init(&job.next_track, 0);
+
+    int i = 0;
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        job.tracks[i++] = track_node->track;
+    }
+
+    if (num_threads > num_tracks) {
+        num_threads = num_tracks;
+    }
+    if (num_threads <= 1) {
+        pairing_worker(&job);
+    } else {
+        pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+        assert(threads != NULL);
+        for (i = 0; i < num_threads; i++) {
+            int result = pthread_create(&threads[i], NULL, pairing_worker, &job);
+            assert(result == 0);
+        }
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+
+    // concatenate the per-track results into one array
+    uint32_t total = 0;
+    for (i = 0; i < num_tracks; i++) {
+        total += job.buffers[i].count;
+    }
+
+    piano_roll_t *roll = malloc(sizeof(piano_roll_t));
+    assert(roll != NULL);
+    roll->spans = malloc((total + 1) * sizeof(note_span_t));
+    assert(roll->spans != NULL);
+    roll->count = total;
+
+    uint32_t offset = 0;
+    for (i = 0; i < num_tracks; i++) {
+        memcpy(&roll->spans[offset], job.buffers[i].spans, job.buffers[i].count * sizeof(note_span_t));
+        offset += job.buffers[i].count;
+        free(job.buffers[i].spans);
+        free(job.buffers[i].below);
+    }
+    free(job.buffers);
+    free(job.tracks);
+    return roll;
+}
+
+static int compare_spans(const void *a, const void *b) {
+    const note_span_t *x = (const note_span_t *) a;
+    const note_span_t *y = (const note_span_t *) b;
+    if (x->start_tick != y->start_tick) {
+        return (x->start_tick > y->start_tick) - (x->start_tick < y->start_tick);
+    }
+    if (x->track != y->track) {
+        return (x->track > y->track) - (x->track < y->track);
+    }
+    return (x->pitch > y->pitch) - (x->pitch < y->pitch);
+}
+
+/*
+ * Reorder the piano roll by start tick, then track, then pitch.
+ */
+void sort_piano_roll(piano_roll_t *roll) {
+    assert(roll != NULL);
+    qsort(roll->spans, roll->count, sizeof(note_span_t), compare_spans);
+}
+
+void free_piano_roll(piano_roll_t *roll) {
+    if (roll == NULL) {
+        return;
+    }
+    free(roll->spans);
+    free(roll);
+}
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,10 +52,21 @@ typedef struct track_node {
     struct track_node *next;
 } track_node_t;
 
+typedef struct {
+    uint16_t channel_mask;
+    uint32_t channel_events[16];
+    uint32_t note_counts[128];
+    uint32_t program_counts[128];
+    uint32_t total_ticks;
+} song_summary_t;
+
 typedef struct {
     uint32_t format;
     uint32_t ticks_per_quarter_note;
     track_node_t *track_list;
+    song_summary_t summary;
+    char *filename;
+    char *song_name;
 } song_data_t;
 
 const char *META_TABLE[] = {
@@ -79,23 +91,161 @@ const char *META_TABLE[] = {
     "Sequencer-Specific Meta-event"
 };
 
-song_data_t *parse_file(const char *filename) {
-    assert(filename != NULL);
+static bool read_checked_byte(FILE *file, uint32_t *left, uint8_t *byte) {
+    if (*left == 0) {
+        return false;
+    }
+    int c = fgetc(file);
+    if (c == EOF) {
+        return false;
+    }
+    (*left)--;
+    *byte = (uint8_t) c;
+    return true;
+}
 
-    // Open the MIDI file in binary mode
-    FILE *file = fopen(filename, "rb");
-    assert(file != NULL);
+static bool read_checked_u32(FILE *file, uint32_t *left, uint32_t *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        uint8_t byte;
+        if (!read_checked_byte(file, left, &byte)) {
+            return false;
+        }
+        *value = (*value << 8) | byte;
+    }
+    return true;
+}
 
-    // Get the size of the file in bytes
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+// a variable length quantity is at most 4 bytes long
+static bool read_checked_var_len(FILE *file, uint32_t *left, uint32_t *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        uint8_t byte;
+        if (!read_checked_byte(file, left, &byte)) {
+            return false;
+        }
+        *value = (*value << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool skip_checked(FILE *file, uint32_t *left, uint32_t count) {
+    if (count > *left || fseek(file, count, SEEK_CUR) != 0) {
+        return false;
+    }
+    *left -= count;
+    return true;
+}
+
+/*
+ * Check that every event of a track chunk of the given length lies inside
+ * the chunk and the chunk ends on an event boundary.
+ */
+static bool track_chunk_valid(FILE *file, uint32_t length) {
+    uint32_t left = length;
+    uint8_t running_status = 0;
+    while (left > 0) {
+        uint32_t delta_time;
+        uint8_t status;
+        if (!read_checked_var_len(file, &left, &delta_time) || !read_checked_byte(file, &left, &status)) {
+            return false;
+        }
+
+        uint32_t data_len;
+        if (status == META_EVENT) {
+            uint8_t meta_type;
+            if (!read_checked_byte(file, &left, &meta_type) || !read_checked_var_len(file, &left, &data_len)) {
+                return false;
+            }
+        } else if (status == SYS_EVENT_1 || status == SYS_EVENT_2) {
+            if (!read_checked_var_len(file, &left, &data_len)) {
+                return false;
+            }
+        } else if (status >= 0xF0) {
+            return false;
+        } else {
+            if (status < 0x80) {
+                // running status, the byte read was the first data byte
+                if (running_status == 0) {
+                    return false;
+                }
+                status = running_status;
+                data_len = ((status >> 4) == 0xC || (status >> 4) == 0xD) ? 0 : 1;
+            } else {
+                data_len = ((status >> 4) == 0xC || (status >> 4) == 0xD) ? 1 : 2;
+            }
+            running_status = status;
+        }
+        if (!skip_checked(file, &left, data_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Walk the chunk structure of a whole MIDI file without building anything,
+ * so malformed input can be rejected before the parser asserts on it. The
+ * stream is left at the start again.
+ */
+static bool midi_stream_valid(FILE *file, long file_size) {
+    if (file_size < 14 || file_size > UINT32_MAX) {
+        return false;
+    }
+    uint32_t left = (uint32_t) file_size;
+
+    uint32_t chunk_type;
+    uint32_t chunk_length;
+    uint8_t header[6];
+    if (!read_checked_u32(file, &left, &chunk_type) || !read_checked_u32(file, &left, &chunk_length) ||
+        chunk_type != 0x4D546864 /* MThd */ || chunk_length != sizeof(header)) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(header); i++) {
+        if (!read_checked_byte(file, &left, &header[i])) {
+            return false;
+        }
+    }
+    uint16_t format = (header[0] << 8) | header[1];
+    uint16_t num_tracks = (header[2] << 8) | header[3];
+    if (format > 2) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < num_tracks; i++) {
+        if (!read_checked_u32(file, &left, &chunk_type) || !read_checked_u32(file, &left, &chunk_length) ||
+            chunk_type != 0x4D54726B /* MTrk */ || chunk_length > left) {
+            return false;
+        }
+        if (!track_chunk_valid(file, chunk_length)) {
+            return false;
+        }
+        left -= chunk_length;
+    }
+
+    // nothing may follow the last track
+    return left == 0 && fseek(file, 0, SEEK_SET) == 0;
+}
+
+/*
+ * Parse a whole MIDI file from an open stream. file_size is the number of
+ * bytes the stream holds, used to check that nothing is left over. Returns
+ * NULL if the stream does not hold a well-formed MIDI file.
+ */
+static song_data_t *parse_stream(FILE *file, const char *filename, long file_size) {
+    if (!midi_stream_valid(file, file_size)) {
+        return NULL;
+    }
 
     // Allocate memory for the song data struct
     song_data_t *song_data = malloc(sizeof(song_data_t));
     assert(song_data != NULL);
 
-    // Copy the filename to the song data struct
+    // Copy the filename to the song data struct, the library names it later
+    song_data->song_name = NULL;
     song_data->filename = malloc(strlen(filename) + 1);
     assert(song_data->filename != NULL);
     strcpy(song_data->filename, filename);
@@ -106,15 +256,65 @@ song_data_t *parse_file(const char *filename) {
     // Parse the track chunks
     parse_track_chunks(file, song_data);
 
+    // Collect the song-wide facts kept up to date by the alterations
+    compute_song_summary(song_data);
+
     // Check if there is any remaining data in the file
     long remaining_data = file_size - ftell(file);
     assert(remaining_data == 0);
 
+    return song_data;
+}
+
+/*
+ * Parse the MIDI file at filename. Returns NULL if the file cannot be
+ * opened or is not a well-formed MIDI file.
+ */
+song_data_t *parse_file(const char *filename) {
+    assert(filename != NULL);
+
+    // Open the MIDI file in binary mode
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    // Get the size of the file in bytes
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    song_data_t *song_data = parse_stream(file, filename, file_size);
+
     // Close the file
     fclose(file);
 
     return song_data;
 }
+
+/*
+ * Parse a MIDI file that has already been read into memory, e.g. by the
+ * asynchronous loader. filename is only recorded in the song data. Returns
+ * NULL if the buffer does not hold a well-formed MIDI file.
+ */
+song_data_t *parse_buffer(const char *filename, uint8_t *data, size_t size) {
+    assert(filename != NULL);
+
+    // fmemopen refuses an empty buffer, which is no MIDI file either
+    if (data == NULL || size == 0) {
+        return NULL;
+    }
+    FILE *file = fmemopen(data, size, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    song_data_t *song_data = parse_stream(file, filename, (long) size);
+
+    fclose(file);
+
+    return song_data;
+}
 void parse_header(FILE *fp, song_data_t *song) {
     // Read chunk type and size
     char chunk_type[5];
@@ -391,6 +591,8 @@ void free_song(song_data_t *song) {
         free_track_node(current_track);
         current_track = next_track;
     }
+    free(song->filename);
+    free(song->song_name);
     free(song);
 }
 
@@ -0,0 +1,472 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include "playback.h"
+
+/**
+ * This file contains a real-time playback engine for parsed songs.
+ *
+ * When a player is created, every track of the song is merged into a single
+ * timeline sorted by tick, and each event gets its song time in microseconds
+ * from the Set Tempo events and ticks_per_quarter_note.
+ *
+ * Two threads run while playing. The scheduler thread pushes events that
+ * fall within the lookahead window into a single-producer single-consumer
+ * ring buffer. The sink thread pops them, waits for each one's exact due
+ * time and calls the output sink. The ring is lock-free so the sink thread
+ * never blocks on the scheduler, which keeps dispatch jitter low under load.
+ * The measured jitter is available through player_get_jitter.
+ */
+
+#define META_SET_TEMPO 0x51
+#define DEFAULT_TEMPO 500000
+#define DEFAULT_LOOKAHEAD_US 20000
+#define RING_CAPACITY 1024
+#define SPIN_THRESHOLD_US 200
+#define CACHE_LINE 64
+
+typedef void (*playback_sink_t)(const event_t *, uint16_t, void *);
+
+typedef struct {
+    uint64_t tick;
+    uint64_t time_us;
+    event_t *event;
+    uint16_t track;
+    uint32_t order;
+} timeline_event_t;
+
+typedef struct {
+    uint64_t due_us;
+    uint32_t index;
+    uint32_t generation;
+} scheduled_event_t;
+
+/*
+ * Lock-free single-producer single-consumer ring. head is only written by
+ * the consumer and tail only by the producer, so each sits on its own
+ * cache line.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) scheduled_event_t slots[RING_CAPACITY];
+} event_ring_t;
+
+typedef struct {
+    uint64_t count;
+    int64_t min_us;
+    int64_t max_us;
+    double mean_us;
+} jitter_stats_t;
+
+typedef struct {
+    timeline_event_t *timeline;
+    uint32_t num_events;
+
+    playback_sink_t sink;
+    void *sink_data;
+    uint64_t lookahead_us;
+
+    event_ring_t ring;
+
+    pthread_t scheduler_thread;
+    pthread_t sink_thread;
+    atomic_bool running;
+
+    // seek requests, packed as sequence << 32 | tick and handled by the
+    // scheduler thread, which stores the sequence of the last one it
+    // published in seek_handled. Repeated seeks to the same tick each get
+    // a new sequence, so none is lost.
+    atomic_ullong seek_request;
+    atomic_uint seek_handled;
+    // bumped on every seek so the sink drops events from before it
+    atomic_uint generation;
+
+    // Progress since the last seek, each packed as generation << 32 | count.
+    // to_dispatch is the number of events from the seek position to the end
+    // and is written by the scheduler, dispatched is the number handed to
+    // the sink so far and is written by the sink thread.
+    atomic_ullong to_dispatch;
+    atomic_ullong dispatched;
+
+    // wall clock time at which song time base_song_us plays
+    atomic_ullong base_wall_us;
+    atomic_ullong base_song_us;
+
+    // only written by the sink thread
+    atomic_ullong jitter_count;
+    atomic_llong jitter_min_us;
+    atomic_llong jitter_max_us;
+    atomic_llong jitter_total_us;
+} player_t;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(uint64_t target_us) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) (target_us / 1000000);
+    ts.tv_nsec = (long) (target_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static bool ring_push(event_ring_t *ring, const scheduled_event_t *entry) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == RING_CAPACITY) {
+        return false;
+    }
+    ring->slots[tail % RING_CAPACITY] = *entry;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_pop(event_ring_t *ring, scheduled_event_t *entry) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    *entry = ring->slots[head % RING_CAPACITY];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+static int compare_timeline_events(const void *a, const void *b) {
+    const timeline_event_t *x = (const timeline_event_t *) a;
+    const timeline_event_t *y = (const timeline_event_t *) b;
+    if (x->tick != y->tick) {
+        return (x->tick > y->tick) - (x->tick < y->tick);
+    }
+    // keep the original track order for events on the same tick
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+/*
+ * Convert a tick delta to microseconds at the given tempo. Songs using SMPTE
+ * division (top bit set) have a fixed number of ticks per second instead.
+ */
+static uint64_t ticks_to_us(uint64_t ticks, uint32_t tempo, uint32_t division) {
+    if (division & 0x8000) {
+        uint32_t frames_per_second = (uint32_t) (-(int8_t) (division >> 8));
+        uint32_t ticks_per_frame = division & 0xFF;
+        return ticks * 1000000 / ((uint64_t) frames_per_second * ticks_per_frame);
+    }
+    return ticks * tempo / division;
+}
+
+/*
+ * Merge every track into one sorted timeline and stamp each event with its
+ * song time, following Set Tempo changes from any track. Times are computed
+ * from the start of the current tempo segment rather than summed per gap,
+ * so rounding does not add up over long songs.
+ */
+static void build_timeline(player_t *player, song_data_t *song) {
+    uint32_t num_events = 0;
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        for (event_node_t *event_node = track_node->track->event_list; event_node != NULL; event_node = event_node->next) {
+            num_events++;
+        }
+    }
+
+    timeline_event_t *timeline = malloc((num_events + 1) * sizeof(timeline_event_t));
+    assert(timeline != NULL);
+
+    uint32_t i = 0;
+    uint16_t track_index = 0;
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        uint64_t tick = 0;
+        for (event_node_t *event_node = track_node->track->event_list; event_node != NULL; event_node = event_node->next) {
+            tick += event_node->event->delta_time;
+            timeline[i].tick = tick;
+            timeline[i].event = event_node->event;
+            timeline[i].track = track_index;
+            timeline[i].order = i;
+            i++;
+        }
+        track_index++;
+    }
+    qsort(timeline, num_events, sizeof(timeline_event_t), compare_timeline_events);
+
+    uint32_t division = song->ticks_per_quarter_note;
+    assert(division != 0);
+    uint32_t tempo = DEFAULT_TEMPO;
+    // tick and song time of the last tempo change
+    uint64_t segment_tick = 0;
+    uint64_t segment_us = 0;
+    for (i = 0; i < num_events; i++) {
+        timeline[i].time_us = segment_us + ticks_to_us(timeline[i].tick - segment_tick, tempo, division);
+
+        event_t *event = timeline[i].event;
+        // SMPTE time does not depend on the tempo, so it stays one segment
+        if (event->type == META_EVENT && !(division & 0x8000)) {
+            meta_event_t *meta_event = (meta_event_t *) event->data;
+            if (meta_event->type == META_SET_TEMPO && meta_event->length == 3) {
+                segment_tick = timeline[i].tick;
+                segment_us = timeline[i].time_us;
+                tempo = ((uint32_t) meta_event->data[0] << 16) |
+                        ((uint32_t) meta_event->data[1] << 8) |
+                        (uint32_t) meta_event->data[2];
+            }
+        }
+    }
+
+    player->timeline = timeline;
+    player->num_events = num_events;
+}
+
+/*
+ * Index of the first timeline event at or after tick.
+ */
+static uint32_t find_tick(player_t *player, uint64_t tick) {
+    uint32_t low = 0;
+    uint32_t high = player->num_events;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (player->timeline[mid].tick < tick) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static uint64_t pack_progress(uint32_t generation, uint32_t count) {
+    return ((uint64_t) generation << 32) | count;
+}
+
+static void *scheduler_main(void *arg) {
+    player_t *player = (player_t *) arg;
+    uint32_t position = 0;
+    uint32_t generation = atomic_load(&player->generation);
+    uint32_t seek_handled = atomic_load(&player->seek_handled);
+
+    while (atomic_load_explicit(&player->running, memory_order_acquire)) {
+        uint64_t seek_request = atomic_load(&player->seek_request);
+        uint32_t seek_sequence = (uint32_t) (seek_request >> 32);
+        if (seek_sequence != seek_handled) {
+            position = find_tick(player, (uint32_t) seek_request);
+            uint64_t song_us = (position < player->num_events) ? player->timeline[position].time_us : 0;
+            atomic_store(&player->base_song_us, song_us);
+            // start one lookahead window out so the first events are not already late
+            atomic_store(&player->base_wall_us, now_us() + player->lookahead_us);
+            atomic_store(&player->to_dispatch, pack_progress(generation + 1, player->num_events - position));
+            generation = atomic_fetch_add(&player->generation, 1) + 1;
+            // the seek only counts as handled once its target is published,
+            // and a newer seek that arrived meanwhile has another sequence
+            seek_handled = seek_sequence;
+            atomic_store(&player->seek_handled, seek_handled);
+        }
+
+        uint64_t base_wall_us = atomic_load(&player->base_wall_us);
+        uint64_t base_song_us = atomic_load(&player->base_song_us);
+        uint64_t horizon_us = now_us() + player->lookahead_us;
+
+        // push everything due within the lookahead window
+        while (position < player->num_events) {
+            uint64_t due_us = base_wall_us + (player->timeline[position].time_us - base_song_us);
+            if (due_us > horizon_us) {
+                break;
+            }
+            scheduled_event_t entry = { due_us, position, generation };
+            if (!ring_push(&player->ring, &entry)) {
+                break;
+            }
+            position++;
+        }
+
+        // wake up again halfway through the lookahead window, and keep
+        // serving seeks after the last event until stopped
+        sleep_until_us(now_us() + player->lookahead_us / 2);
+    }
+    return NULL;
+}
+
+static void record_jitter(player_t *player, int64_t jitter_us) {
+    uint64_t count = atomic_load_explicit(&player->jitter_count, memory_order_relaxed);
+    if (count == 0 || jitter_us < atomic_load_explicit(&player->jitter_min_us, memory_order_relaxed)) {
+        atomic_store_explicit(&player->jitter_min_us, jitter_us, memory_order_relaxed);
+    }
+    if (count == 0 || jitter_us > atomic_load_explicit(&player->jitter_max_us, memory_order_relaxed)) {
+        atomic_store_explicit(&player->jitter_max_us, jitter_us, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&player->jitter_total_us, jitter_us, memory_order_relaxed);
+    atomic_store_explicit(&player->jitter_count, count + 1, memory_order_release);
+}
+
+static void *sink_main(void *arg) {
+    player_t *player = (player_t *) arg;
+    uint32_t generation = atomic_load(&player->generation);
+    uint32_t dispatched = 0;
+
+    while (atomic_load_explicit(&player->running, memory_order_acquire)) {
+        scheduled_event_t entry;
+        if (!ring_pop(&player->ring, &entry)) {
+            sleep_until_us(now_us() + SPIN_THRESHOLD_US / 2);
+            continue;
+        }
+        if (entry.generation != atomic_load(&player->generation)) {
+            // scheduled before a seek
+            continue;
+        }
+
+        // sleep most of the way, then spin for the last stretch
+        if (entry.due_us > now_us() + SPIN_THRESHOLD_US) {
+            sleep_until_us(entry.due_us - SPIN_THRESHOLD_US);
+        }
+        uint64_t now = now_us();
+        while (now < entry.due_us) {
+            now = now_us();
+        }
+        if (entry.generation != atomic_load(&player->generation)) {
+            continue;
+        }
+
+        timeline_event_t *timeline_event = &player->timeline[entry.index];
+        player->sink(timeline_event->event, timeline_event->track, player->sink_data);
+        record_jitter(player, (int64_t) (now - entry.due_us));
+
+        if (entry.generation != generation) {
+            generation = entry.generation;
+            dispatched = 0;
+        }
+        dispatched++;
+        atomic_store(&player->dispatched, pack_progress(generation, dispatched));
+    }
+    return NULL;
+}
+
+/*
+ * Create a player for the song. Events are handed to sink along with the
+ * index of the track they came from. The song must not be altered while the
+ * player exists. A lookahead_us of 0 selects the default window.
+ */
+player_t *new_player(song_data_t *song, playback_sink_t sink, void *sink_data, uint32_t lookahead_us) {
+    assert(song != NULL && sink != NULL);
+
+    player_t *player = aligned_alloc(CACHE_LINE, (sizeof(player_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    assert(player != NULL);
+    memset(player, 0, sizeof(player_t));
+
+    build_timeline(player, song);
+    player->sink = sink;
+    player->sink_data = sink_data;
+    player->lookahead_us = lookahead_us ? lookahead_us : DEFAULT_LOOKAHEAD_US;
+    atomic_init(&player->ring.head, 0);
+    atomic_init(&player->ring.tail, 0);
+    atomic_init(&player->running, false);
+    atomic_init(&player->seek_request, 0);
+    atomic_init(&player->seek_handled, 0);
+    atomic_init(&player->generation, 0);
+    atomic_init(&player->to_dispatch, 0);
+    atomic_init(&player->dispatched, 0);
+    return player;
+}
+
+static void request_seek(player_t *player, uint32_t tick) {
+    uint64_t request = atomic_load(&player->seek_request);
+    uint64_t next;
+    do {
+        next = ((uint64_t) ((uint32_t) (request >> 32) + 1) << 32) | tick;
+    } while (!atomic_compare_exchange_weak(&player->seek_request, &request, next));
+}
+
+/*
+ * Start playing from the given tick.
+ */
+void player_start(player_t *player, uint32_t tick) {
+    assert(player != NULL);
+    assert(!atomic_load(&player->running));
+
+    request_seek(player, tick);
+    atomic_store(&player->running, true);
+
+    int result = pthread_create(&player->sink_thread, NULL, sink_main, player);
+    assert(result == 0);
+    result = pthread_create(&player->scheduler_thread, NULL, scheduler_main, player);
+    assert(result == 0);
+}
+
+/*
+ * Jump to the given tick while playing. Events already queued for the old
+ * position are dropped.
+ */
+void player_seek(player_t *player, uint32_t tick) {
+    assert(player != NULL);
+    request_seek(player, tick);
+}
+
+/*
+ * True once the sink has returned from every event after the last seek.
+ */
+bool player_finished(player_t *player) {
+    assert(player != NULL);
+    if ((uint32_t) (atomic_load(&player->seek_request) >> 32) != atomic_load(&player->seek_handled)) {
+        return false;
+    }
+    uint64_t to_dispatch = atomic_load(&player->to_dispatch);
+    // nothing left to play when seeking past the last event
+    return (uint32_t) to_dispatch == 0 || atomic_load(&player->dispatched) == to_dispatch;
+}
+
+void player_stop(player_t *player) {
+    assert(player != NULL);
+    if (!atomic_exchange(&player->running, false)) {
+        return;
+    }
+    pthread_join(player->scheduler_thread, NULL);
+    pthread_join(player->sink_thread, NULL);
+
+    // drop anything still queued
+    scheduled_event_t entry;
+    while (ring_pop(&player->ring, &entry)) {
+    }
+}
+
+void player_get_jitter(player_t *player, jitter_stats_t *stats) {
+    assert(player != NULL && stats != NULL);
+    stats->count = atomic_load_explicit(&player->jitter_count, memory_order_acquire);
+    stats->min_us = atomic_load_explicit(&player->jitter_min_us, memory_order_relaxed);
+    stats->max_us = atomic_load_explicit(&player->jitter_max_us, memory_order_relaxed);
+    long long total_us = atomic_load_explicit(&player->jitter_total_us, memory_order_relaxed);
+    stats->mean_us = stats->count ? (double) total_us / (double) stats->count : 0.0;
+}
+
+void free_player(player_t *player) {
+    if (player == NULL) {
+        return;
+    }
+    player_stop(player);
+    free(player->timeline);
+    free(player);
+}
+
+/*
+ * Sink that discards every event, for measuring the scheduler on its own.
+ */
+void null_sink(const event_t *event, uint16_t track, void *data) {
+    (void) event;
+    (void) track;
+    (void) data;
+}
+
+/*
+ * Sink that logs each event to the FILE * passed as data, one per line, with
+ * the wall clock time it was dispatched.
+ */
+void file_sink(const event_t *event, uint16_t track, void *data) {
+    FILE *fp = (FILE *) data;
+    fprintf(fp, "%llu %u 0x%02X\n", (unsigned long long) now_us(), track, event->type);
+}
@@ -0,0 +1,887 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "epoch.h"
+#include "similarity.h"
+
+/**
+ * This file contains a musical similarity index over the song library.
+ * Every song is reduced to the set of pitch-interval n-grams found in its
+ * tracks. Interval n-grams are transposition invariant, so a melody matches
+ * regardless of key. Two structures are kept over those sets:
+ *
+ *   - an inverted index from n-gram to the songs containing it, used for
+ *     "which songs contain this melody" queries, and
+ *   - MinHash signatures bucketed by LSH bands, used to find near-duplicate
+ *     songs without comparing against the whole library.
+ *
+ * Both queries only touch the posting lists of the query's own n-grams or
+ * bands. Very common n-grams (repeated notes, scale runs) would otherwise
+ * have posting lists covering most of the library, so an n-gram list that
+ * reaches STOP_GRAM_LIMIT songs becomes a stop-gram: it takes no more songs
+ * and queries skip it, the same way a text index drops words with a low
+ * inverse document frequency. A melody query therefore touches at most
+ * STOP_GRAM_LIMIT songs per n-gram, however large the library grows. Band
+ * lists have no limit: songs only share a band when their signatures agree
+ * on a whole band, so a large band list is a real cluster of near-duplicates
+ * and dropping it would hide them. A near-duplicate query costs as much as
+ * the clusters the song belongs to.
+ *
+ * The index follows the same reader/writer scheme as g_song_library and
+ * shares its epoch domain. Writers (similarity_index_add and
+ * similarity_index_remove) must hold the library's write lock. Queries may
+ * run at the same time without locking. Nothing a query can reach is
+ * changed in place: growing arrays are copied, published with one atomic
+ * store and retired through the epoch domain, and a posting list only
+ * grows past the count a reader loaded. Everything one writer call replaces
+ * is retired in a single batch. A removed song is taken out of its posting
+ * lists, which only count live songs toward STOP_GRAM_LIMIT, and leaves a
+ * tombstone for queries that loaded a list before; its id is reused once
+ * no reader can still hold it. The matches a query returns are only valid
+ * while the caller is inside a library read section.
+ */
+
+#define NOTE_ON_STATUS 0x9
+
+#define NGRAM_LENGTH 4
+#define MINHASH_SIZE 64
+#define LSH_BANDS 16
+#define LSH_ROWS (MINHASH_SIZE / LSH_BANDS)
+
+#define STOP_GRAM_LIMIT 2048
+#define INITIAL_TABLE_SLOTS 1024
+#define INITIAL_POSTING_CAPACITY 4
+#define INITIAL_ID_SLOTS 64
+
+/*
+ * The ids of one posting list. The count lives in the same block as the ids
+ * so a reader always loads a matching pair.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t song_ids[];
+} posting_ids_t;
+
+typedef struct {
+    uint64_t key;
+    // NULL while the slot is empty
+    posting_ids_t *ids;
+    // too common to tell songs apart, skipped by queries and no longer grown
+    bool stopped;
+} posting_list_t;
+
+typedef struct {
+    size_t num_slots;
+    posting_list_t slots[];
+} posting_slots_t;
+
+typedef struct {
+    posting_slots_t *slots;
+    size_t num_used;
+    // lists stop taking songs at this many, 0 for no limit
+    uint32_t stop_limit;
+} posting_table_t;
+
+// what a reader loaded of one posting list
+typedef struct {
+    const uint32_t *song_ids;
+    uint32_t count;
+    bool stopped;
+} posting_view_t;
+
+typedef struct {
+    // NULL once the song is removed
+    song_data_t *song;
+    uint32_t signature[MINHASH_SIZE];
+} indexed_song_t;
+
+// the n-grams an id was posted under, so removal can take it out again
+typedef struct {
+    uint64_t *ngrams;
+    size_t num_ngrams;
+} song_keys_t;
+
+typedef struct {
+    song_data_t *song;
+    uint32_t song_id;
+} song_id_slot_t;
+
+// memory replaced during one writer call, retired together at the end
+typedef struct {
+    void **ptrs;
+    int count;
+    int capacity;
+} retire_batch_t;
+
+typedef struct similarity_index {
+    epoch_domain_t *domain;
+    posting_table_t ngrams;
+    posting_table_t bands;
+    indexed_song_t *songs;
+    // ids handed out so far, live or free
+    uint32_t num_songs;
+    uint32_t songs_capacity;
+
+    // the rest is only used by writers
+    song_keys_t *keys;
+    song_id_slot_t *id_slots;
+    size_t num_id_slots;
+    size_t num_ids;
+
+    // ids of removed songs that no reader can still hold, ready for reuse
+    pthread_mutex_t free_ids_lock;
+    uint32_t *free_ids;
+    uint32_t num_free_ids;
+    uint32_t free_ids_capacity;
+} similarity_index_t;
+
+typedef struct {
+    similarity_index_t *index;
+    uint32_t song_id;
+} released_id_t;
+
+typedef struct {
+    song_data_t *song;
+    float score;
+} similarity_match_t;
+
+typedef struct {
+    uint64_t *hashes;
+    size_t count;
+    size_t capacity;
+} hash_set_t;
+
+// everything the index needs from a song's tracks
+typedef struct {
+    hash_set_t ngrams;
+    uint32_t signature[MINHASH_SIZE];
+} similarity_fingerprint_t;
+
+static uint64_t mix64(uint64_t x) {
+    // splitmix64 finalizer
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_matches(const void *a, const void *b) {
+    float x = ((const similarity_match_t *) a)->score;
+    float y = ((const similarity_match_t *) b)->score;
+    return (x < y) - (x > y);
+}
+
+static void hash_set_push(hash_set_t *set, uint64_t hash) {
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity ? set->capacity * 2 : 64;
+        set->hashes = realloc(set->hashes, set->capacity * sizeof(uint64_t));
+        assert(set->hashes != NULL);
+    }
+    set->hashes[set->count++] = hash;
+}
+
+/*
+ * Sort the hashes and drop duplicates so the set can be used both for
+ * postings (one entry per song) and for MinHash.
+ */
+static void hash_set_finish(hash_set_t *set) {
+    if (set->count == 0) {
+        return;
+    }
+    qsort(set->hashes, set->count, sizeof(uint64_t), compare_u64);
+    size_t unique = 1;
+    for (size_t i = 1; i < set->count; i++) {
+        if (set->hashes[i] != set->hashes[unique - 1]) {
+            set->hashes[unique++] = set->hashes[i];
+        }
+    }
+    set->count = unique;
+}
+
+/*
+ * Hash NGRAM_LENGTH consecutive intervals starting at notes[0]. Intervals are
+ * clamped to a signed byte, which covers every interval a MIDI key can make.
+ */
+static uint64_t hash_ngram(const uint8_t *notes) {
+    uint64_t packed = 0;
+    for (int i = 0; i < NGRAM_LENGTH; i++) {
+        int8_t interval = (int8_t) ((int) notes[i + 1] - (int) notes[i]);
+        packed = (packed << 8) | (uint8_t) interval;
+    }
+    return mix64(packed);
+}
+
+static void add_ngrams(hash_set_t *set, const uint8_t *notes, size_t num_notes) {
+    if (num_notes <= NGRAM_LENGTH) {
+        return;
+    }
+    for (size_t i = 0; i + NGRAM_LENGTH < num_notes; i++) {
+        hash_set_push(set, hash_ngram(&notes[i]));
+    }
+}
+
+/*
+ * Collect the interval n-grams of every track in the song. Each track is
+ * treated as its own melodic line so n-grams never span two tracks.
+ */
+static void extract_fingerprints(song_data_t *song, hash_set_t *set) {
+    uint8_t *notes = NULL;
+    size_t capacity = 0;
+
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        size_t num_notes = 0;
+        for (event_node_t *event_node = track_node->track->event_list; event_node != NULL; event_node = event_node->next) {
+            event_t *event = event_node->event;
+            if (event->type == META_EVENT || event->type == SYS_EVENT_1 || event->type == SYS_EVENT_2) {
+                continue;
+            }
+            midi_event_t *midi_event = (midi_event_t *) event->data;
+            // Note On with velocity 0 is a Note Off
+            if ((midi_event->status >> 4) != NOTE_ON_STATUS || midi_event->data[1] == 0) {
+                continue;
+            }
+            if (num_notes == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                notes = realloc(notes, capacity);
+                assert(notes != NULL);
+            }
+            notes[num_notes++] = midi_event->data[0];
+        }
+        add_ngrams(set, notes, num_notes);
+    }
+
+    free(notes);
+    hash_set_finish(set);
+}
+
+static void compute_signature(const hash_set_t *set, uint32_t signature[MINHASH_SIZE]) {
+    for (int i = 0; i < MINHASH_SIZE; i++) {
+        signature[i] = UINT32_MAX;
+    }
+    for (size_t j = 0; j < set->count; j++) {
+        for (int i = 0; i < MINHASH_SIZE; i++) {
+            uint32_t h = (uint32_t) mix64(set->hashes[j] ^ mix64((uint64_t) i));
+            if (h < signature[i]) {
+                signature[i] = h;
+            }
+        }
+    }
+}
+
+static uint64_t band_key(const uint32_t signature[MINHASH_SIZE], int band) {
+    uint64_t key = mix64((uint64_t) band);
+    for (int r = 0; r < LSH_ROWS; r++) {
+        key = mix64(key ^ signature[band * LSH_ROWS + r]);
+    }
+    return key;
+}
+
+static void defer_retire(retire_batch_t *batch, void *ptr) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 16;
+        batch->ptrs = realloc(batch->ptrs, batch->capacity * sizeof(void *));
+        assert(batch->ptrs != NULL);
+    }
+    batch->ptrs[batch->count++] = ptr;
+}
+
+static posting_ids_t *new_posting_ids(uint32_t capacity) {
+    posting_ids_t *ids = malloc(sizeof(posting_ids_t) + capacity * sizeof(uint32_t));
+    assert(ids != NULL);
+    ids->count = 0;
+    ids->capacity = capacity;
+    return ids;
+}
+
+static posting_slots_t *new_posting_slots(size_t num_slots) {
+    posting_slots_t *slots = calloc(1, sizeof(posting_slots_t) + num_slots * sizeof(posting_list_t));
+    assert(slots != NULL);
+    slots->num_slots = num_slots;
+    return slots;
+}
+
+static void posting_table_init(posting_table_t *table, uint32_t stop_limit) {
+    table->slots = new_posting_slots(INITIAL_TABLE_SLOTS);
+    table->num_used = 0;
+    table->stop_limit = stop_limit;
+}
+
+static void posting_table_free(posting_table_t *table) {
+    for (size_t i = 0; i < table->slots->num_slots; i++) {
+        free(table->slots->slots[i].ids);
+    }
+    free(table->slots);
+    table->slots = NULL;
+    table->num_used = 0;
+}
+
+/*
+ * Open addressing with linear probing. A slot without ids is empty. Slots
+ * are never emptied again once taken, so probe sequences stay intact. ids
+ * is set last when a slot is taken, so a reader that sees it also sees the
+ * key.
+ */
+static posting_list_t *posting_slot(posting_slots_t *slots, uint64_t key) {
+    size_t mask = slots->num_slots - 1;
+    size_t i = (size_t) key & mask;
+    while (__atomic_load_n(&slots->slots[i].ids, __ATOMIC_ACQUIRE) != NULL && slots->slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return &slots->slots[i];
+}
+
+/*
+ * Load the posting list for key. The view is empty if no song has the key
+ * or it is a stop-gram. A block of ids is only ever appended to past the
+ * count a reader loaded, or replaced as a whole, so the view stays valid
+ * for the rest of the read section.
+ */
+static void posting_table_view(posting_table_t *table, uint64_t key, posting_view_t *view) {
+    posting_list_t *list = posting_slot(__atomic_load_n(&table->slots, __ATOMIC_ACQUIRE), key);
+    view->song_ids = NULL;
+    view->count = 0;
+    view->stopped = false;
+    posting_ids_t *ids = __atomic_load_n(&list->ids, __ATOMIC_ACQUIRE);
+    if (ids == NULL) {
+        return;
+    }
+    if (__atomic_load_n(&list->stopped, __ATOMIC_ACQUIRE)) {
+        view->stopped = true;
+        return;
+    }
+    view->count = __atomic_load_n(&ids->count, __ATOMIC_ACQUIRE);
+    view->song_ids = ids->song_ids;
+}
+
+static void posting_table_grow(posting_table_t *table, retire_batch_t *retired) {
+    posting_slots_t *old_slots = table->slots;
+    posting_slots_t *slots = new_posting_slots(old_slots->num_slots * 2);
+
+    for (size_t i = 0; i < old_slots->num_slots; i++) {
+        if (old_slots->slots[i].ids != NULL) {
+            *posting_slot(slots, old_slots->slots[i].key) = old_slots->slots[i];
+        }
+    }
+    __atomic_store_n(&table->slots, slots, __ATOMIC_RELEASE);
+    // the ids now belong to the new slots, only the old array goes
+    defer_retire(retired, old_slots);
+}
+
+static void posting_list_append(posting_list_t *list, uint32_t song_id, retire_batch_t *retired) {
+    posting_ids_t *ids = list->ids;
+    if (ids->count == ids->capacity) {
+        posting_ids_t *grown = new_posting_ids(ids->capacity * 2);
+        memcpy(grown->song_ids, ids->song_ids, ids->count * sizeof(uint32_t));
+        grown->song_ids[ids->count] = song_id;
+        grown->count = ids->count + 1;
+        __atomic_store_n(&list->ids, grown, __ATOMIC_RELEASE);
+        defer_retire(retired, ids);
+        return;
+    }
+    // readers never look past count, so the slot can be written first
+    ids->song_ids[ids->count] = song_id;
+    __atomic_store_n(&ids->count, ids->count + 1, __ATOMIC_RELEASE);
+}
+
+static void posting_table_add(posting_table_t *table, uint64_t key, uint32_t song_id, retire_batch_t *retired) {
+    // keep the load factor under 3/4
+    if ((table->num_used + 1) * 4 > table->slots->num_slots * 3) {
+        posting_table_grow(table, retired);
+    }
+
+    posting_list_t *list = posting_slot(table->slots, key);
+    if (list->ids == NULL) {
+        list->key = key;
+        __atomic_store_n(&list->ids, new_posting_ids(INITIAL_POSTING_CAPACITY), __ATOMIC_RELEASE);
+        table->num_used++;
+    }
+
+    // a song's keys are added one after another, so a repeat is the last id
+    posting_ids_t *ids = list->ids;
+    if (list->stopped || (ids->count > 0 && ids->song_ids[ids->count - 1] == song_id)) {
+        return;
+    }
+    // removed songs are taken out of their lists, so only live ids count
+    if (table->stop_limit != 0 && ids->count == table->stop_limit) {
+        __atomic_store_n(&list->stopped, true, __ATOMIC_RELEASE);
+        return;
+    }
+    posting_list_append(list, song_id, retired);
+}
+
+/*
+ * Take song_id out of the posting list for key by publishing a copy of the
+ * list without it. A stop-gram stays one, since it stopped taking songs.
+ */
+static void posting_table_remove(posting_table_t *table, uint64_t key, uint32_t song_id, retire_batch_t *retired) {
+    posting_list_t *list = posting_slot(table->slots, key);
+    posting_ids_t *ids = list->ids;
+    if (ids == NULL) {
+        return;
+    }
+    uint32_t i = 0;
+    while (i < ids->count && ids->song_ids[i] != song_id) {
+        i++;
+    }
+    if (i == ids->count) {
+        return;
+    }
+
+    posting_ids_t *copy = new_posting_ids(ids->capacity);
+    memcpy(copy->song_ids, ids->song_ids, i * sizeof(uint32_t));
+    memcpy(&copy->song_ids[i], &ids->song_ids[i + 1], (ids->count - i - 1) * sizeof(uint32_t));
+    copy->count = ids->count - 1;
+    __atomic_store_n(&list->ids, copy, __ATOMIC_RELEASE);
+    defer_retire(retired, ids);
+}
+
+static size_t song_id_home(const similarity_index_t *index, const song_data_t *song) {
+    return (size_t) mix64((uint64_t) (uintptr_t) song) & (index->num_id_slots - 1);
+}
+
+static size_t song_id_slot(const similarity_index_t *index, const song_data_t *song) {
+    size_t mask = index->num_id_slots - 1;
+    size_t i = song_id_home(index, song);
+    while (index->id_slots[i].song != NULL && index->id_slots[i].song != song) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void song_ids_put(similarity_index_t *index, song_data_t *song, uint32_t song_id) {
+    // keep the load factor under 1/2
+    if ((index->num_ids + 1) * 2 > index->num_id_slots) {
+        song_id_slot_t *old_slots = index->id_slots;
+        size_t old_num_slots = index->num_id_slots;
+        index->num_id_slots = old_num_slots ? old_num_slots * 2 : INITIAL_ID_SLOTS;
+        index->id_slots = calloc(index->num_id_slots, sizeof(song_id_slot_t));
+        assert(index->id_slots != NULL);
+        for (size_t i = 0; i < old_num_slots; i++) {
+            if (old_slots[i].song != NULL) {
+                index->id_slots[song_id_slot(index, old_slots[i].song)] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    size_t i = song_id_slot(index, song);
+    index->id_slots[i].song = song;
+    index->id_slots[i].song_id = song_id;
+    index->num_ids++;
+}
+
+/*
+ * Remove the song from the id map. Returns false if it is not indexed.
+ */
+static bool song_ids_take(similarity_index_t *index, song_data_t *song, uint32_t *song_id) {
+    if (index->num_id_slots == 0) {
+        return false;
+    }
+    size_t mask = index->num_id_slots - 1;
+    size_t hole = song_id_slot(index, song);
+    if (index->id_slots[hole].song == NULL) {
+        return false;
+    }
+    *song_id = index->id_slots[hole].song_id;
+
+    // shift later entries back so no probe sequence crosses an empty slot
+    for (size_t i = (hole + 1) & mask; index->id_slots[i].song != NULL; i = (i + 1) & mask) {
+        size_t home = song_id_home(index, index->id_slots[i].song);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            index->id_slots[hole] = index->id_slots[i];
+            hole = i;
+        }
+    }
+    index->id_slots[hole].song = NULL;
+    index->num_ids--;
+    return true;
+}
+
+/*
+ * Runs once no reader can still hold the id of a removed song, and makes
+ * the id available again.
+ */
+static void release_song_id(void *arg) {
+    released_id_t *released = (released_id_t *) arg;
+    similarity_index_t *index = released->index;
+    pthread_mutex_lock(&index->free_ids_lock);
+    if (index->num_free_ids == index->free_ids_capacity) {
+        index->free_ids_capacity = index->free_ids_capacity ? index->free_ids_capacity * 2 : 64;
+        index->free_ids = realloc(index->free_ids, index->free_ids_capacity * sizeof(uint32_t));
+        assert(index->free_ids != NULL);
+    }
+    index->free_ids[index->num_free_ids++] = released->song_id;
+    pthread_mutex_unlock(&index->free_ids_lock);
+    free(released);
+}
+
+/*
+ * Hand out an id, reusing a released one if there is any, and make room
+ * for its entry.
+ */
+static uint32_t take_song_id(similarity_index_t *index, retire_batch_t *retired) {
+    uint32_t song_id = UINT32_MAX;
+    pthread_mutex_lock(&index->free_ids_lock);
+    if (index->num_free_ids > 0) {
+        song_id = index->free_ids[--index->num_free_ids];
+    }
+    pthread_mutex_unlock(&index->free_ids_lock);
+    if (song_id != UINT32_MAX) {
+        return song_id;
+    }
+
+    if (index->num_songs == index->songs_capacity) {
+        indexed_song_t *old_songs = index->songs;
+        index->songs_capacity = index->songs_capacity ? index->songs_capacity * 2 : 64;
+        indexed_song_t *songs = malloc(index->songs_capacity * sizeof(indexed_song_t));
+        assert(songs != NULL);
+        memcpy(songs, old_songs, index->num_songs * sizeof(indexed_song_t));
+        __atomic_store_n(&index->songs, songs, __ATOMIC_RELEASE);
+        defer_retire(retired, old_songs);
+
+        index->keys = realloc(index->keys, index->songs_capacity * sizeof(song_keys_t));
+        assert(index->keys != NULL);
+    }
+    return index->num_songs++;
+}
+
+/*
+ * Create an empty index whose readers are protected by the given epoch
+ * domain, normally library_epoch().
+ */
+similarity_index_t *new_similarity_index(epoch_domain_t *domain) {
+    assert(domain != NULL);
+    similarity_index_t *index = malloc(sizeof(similarity_index_t));
+    assert(index != NULL);
+    index->domain = domain;
+    posting_table_init(&index->ngrams, STOP_GRAM_LIMIT);
+    // bands are never stopped, see the top of the file
+    posting_table_init(&index->bands, 0);
+    index->songs = NULL;
+    index->num_songs = 0;
+    index->songs_capacity = 0;
+    index->keys = NULL;
+    index->id_slots = NULL;
+    index->num_id_slots = 0;
+    index->num_ids = 0;
+    pthread_mutex_init(&index->free_ids_lock, NULL);
+    index->free_ids = NULL;
+    index->num_free_ids = 0;
+    index->free_ids_capacity = 0;
+    return index;
+}
+
+/*
+ * Free the index. No query may still be running, and it must not be called
+ * from inside a read section, since ids still waiting for release are
+ * waited for first.
+ */
+void free_similarity_index(similarity_index_t *index) {
+    if (index == NULL) {
+        return;
+    }
+    epoch_synchronize(index->domain);
+    posting_table_free(&index->ngrams);
+    posting_table_free(&index->bands);
+    for (size_t i = 0; i < index->num_id_slots; i++) {
+        if (index->id_slots[i].song != NULL) {
+            free(index->keys[index->id_slots[i].song_id].ngrams);
+        }
+    }
+    free(index->keys);
+    free(index->songs);
+    free(index->id_slots);
+    pthread_mutex_destroy(&index->free_ids_lock);
+    free(index->free_ids);
+    free(index);
+}
+
+/*
+ * Compute the fingerprint of a song from its tracks. It can be taken while
+ * the tracks are loaded and added to the index later, after the song cache
+ * may have evicted them.
+ */
+similarity_fingerprint_t *similarity_fingerprint(song_data_t *song) {
+    assert(song != NULL);
+    similarity_fingerprint_t *fingerprint = malloc(sizeof(similarity_fingerprint_t));
+    assert(fingerprint != NULL);
+    fingerprint->ngrams = (hash_set_t) { NULL, 0, 0 };
+    extract_fingerprints(song, &fingerprint->ngrams);
+    compute_signature(&fingerprint->ngrams, fingerprint->signature);
+    return fingerprint;
+}
+
+void free_similarity_fingerprint(similarity_fingerprint_t *fingerprint) {
+    if (fingerprint == NULL) {
+        return;
+    }
+    free(fingerprint->ngrams.hashes);
+    free(fingerprint);
+}
+
+/*
+ * Add the song to both the n-gram and LSH tables under the given
+ * fingerprint, without touching its tracks. Must be called with the
+ * library's write lock held. The index owns neither the song nor the
+ * fingerprint; the song must be removed with similarity_index_remove before
+ * it is freed.
+ */
+void similarity_index_add_fingerprint(similarity_index_t *index, song_data_t *song,
+                                      const similarity_fingerprint_t *fingerprint) {
+    assert(index != NULL && song != NULL && fingerprint != NULL);
+    retire_batch_t retired = { NULL, 0, 0 };
+
+    // no posting list holds the id, so no reader can see the entry yet
+    uint32_t song_id = take_song_id(index, &retired);
+    indexed_song_t *entry = &index->songs[song_id];
+    memcpy(entry->signature, fingerprint->signature, sizeof(entry->signature));
+    __atomic_store_n(&entry->song, song, __ATOMIC_RELEASE);
+    song_ids_put(index, song, song_id);
+
+    const hash_set_t *set = &fingerprint->ngrams;
+    song_keys_t *keys = &index->keys[song_id];
+    keys->num_ngrams = set->count;
+    keys->ngrams = malloc((set->count + 1) * sizeof(uint64_t));
+    assert(keys->ngrams != NULL);
+    memcpy(keys->ngrams, set->hashes, set->count * sizeof(uint64_t));
+
+    for (size_t i = 0; i < set->count; i++) {
+        posting_table_add(&index->ngrams, set->hashes[i], song_id, &retired);
+    }
+    if (set->count > 0) {
+        for (int band = 0; band < LSH_BANDS; band++) {
+            posting_table_add(&index->bands, band_key(entry->signature, band), song_id, &retired);
+        }
+    }
+    epoch_retire_batch(index->domain, retired.ptrs, retired.count, free);
+}
+
+/*
+ * Fingerprint the song and add it to the index. Must be called with the
+ * library's write lock held, while the song's tracks are loaded.
+ */
+void similarity_index_add(similarity_index_t *index, song_data_t *song) {
+    similarity_fingerprint_t *fingerprint = similarity_fingerprint(song);
+    similarity_index_add_fingerprint(index, song, fingerprint);
+    free_similarity_fingerprint(fingerprint);
+}
+
+/*
+ * Take the song out of every posting list it is in and leave a tombstone in
+ * its entry for readers that loaded a list before. Its id is reused once no
+ * reader can still hold it. Must be called with the library's write lock
+ * held, before the song is retired. Does nothing if the song is not in the
+ * index.
+ */
+void similarity_index_remove(similarity_index_t *index, song_data_t *song) {
+    assert(index != NULL && song != NULL);
+    uint32_t song_id;
+    if (!song_ids_take(index, song, &song_id)) {
+        return;
+    }
+    retire_batch_t retired = { NULL, 0, 0 };
+
+    indexed_song_t *entry = &index->songs[song_id];
+    __atomic_store_n(&entry->song, NULL, __ATOMIC_RELEASE);
+    song_keys_t *keys = &index->keys[song_id];
+    for (size_t i = 0; i < keys->num_ngrams; i++) {
+        posting_table_remove(&index->ngrams, keys->ngrams[i], song_id, &retired);
+    }
+    if (keys->num_ngrams > 0) {
+        for (int band = 0; band < LSH_BANDS; band++) {
+            posting_table_remove(&index->bands, band_key(entry->signature, band), song_id, &retired);
+        }
+    }
+    free(keys->ngrams);
+    keys->ngrams = NULL;
+    keys->num_ngrams = 0;
+    epoch_retire_batch(index->domain, retired.ptrs, retired.count, free);
+
+    released_id_t *released = malloc(sizeof(released_id_t));
+    assert(released != NULL);
+    released->index = index;
+    released->song_id = song_id;
+    epoch_retire(index->domain, released, release_song_id);
+}
+
+/*
+ * Sort the gathered candidate ids and turn each run into one match. Runs are
+ * scored by score_func and kept when they reach min_score; removed songs are
+ * skipped. Returns the number of matches written, best first.
+ */
+static int collect_matches(similarity_index_t *index, uint32_t *candidates, size_t num_candidates,
+                           float (*score_func)(const indexed_song_t *, size_t, void *), void *data,
+                           float min_score, similarity_match_t *matches, int max_matches) {
+    if (num_candidates == 0 || max_matches <= 0) {
+        return 0;
+    }
+    qsort(candidates, num_candidates, sizeof(uint32_t), compare_u32);
+
+    // loaded after the posting lists, so it covers every id found in them
+    const indexed_song_t *songs = __atomic_load_n(&index->songs, __ATOMIC_ACQUIRE);
+
+    size_t num_runs = 0;
+    similarity_match_t *found = malloc(num_candidates * sizeof(similarity_match_t));
+    assert(found != NULL);
+
+    size_t start = 0;
+    while (start < num_candidates) {
+        size_t end = start;
+        while (end < num_candidates && candidates[end] == candidates[start]) {
+            end++;
+        }
+        const indexed_song_t *entry = &songs[candidates[start]];
+        song_data_t *song = __atomic_load_n(&entry->song, __ATOMIC_ACQUIRE);
+        if (song != NULL) {
+            float score = score_func(entry, end - start, data);
+            if (score >= min_score) {
+                found[num_runs].song = song;
+                found[num_runs].score = score;
+                num_runs++;
+            }
+        }
+        start = end;
+    }
+
+    qsort(found, num_runs, sizeof(similarity_match_t), compare_matches);
+    int num_matches = (num_runs < (size_t) max_matches) ? (int) num_runs : max_matches;
+    memcpy(matches, found, num_matches * sizeof(similarity_match_t));
+    free(found);
+    return num_matches;
+}
+
+/*
+ * Copy the ids of every view into one array.
+ */
+static uint32_t *gather_candidates(const posting_view_t *views, size_t num_views, size_t *num_candidates) {
+    size_t count = 0;
+    for (size_t i = 0; i < num_views; i++) {
+        count += views[i].count;
+    }
+    uint32_t *candidates = malloc((count + 1) * sizeof(uint32_t));
+    assert(candidates != NULL);
+    count = 0;
+    for (size_t i = 0; i < num_views; i++) {
+        if (views[i].count > 0) {
+            memcpy(&candidates[count], views[i].song_ids, views[i].count * sizeof(uint32_t));
+            count += views[i].count;
+        }
+    }
+    *num_candidates = count;
+    return candidates;
+}
+
+static float melody_score(const indexed_song_t *entry, size_t hits, void *data) {
+    (void) entry;
+    return (float) hits / (float) *(size_t *) data;
+}
+
+/*
+ * Find songs containing the given melody, written as a sequence of MIDI note
+ * numbers. The score of a match is the fraction of the melody's n-grams that
+ * appear in the song, so 1.0 means every interval pattern was found.
+ * Stop-grams are left out of both the search and the score, so a melody made
+ * only of stop-grams matches nothing.
+ */
+int similarity_find_melody(similarity_index_t *index, const uint8_t *notes, int num_notes,
+                           float min_score, similarity_match_t *matches, int max_matches) {
+    assert(index != NULL && notes != NULL && matches != NULL);
+
+    hash_set_t set = { NULL, 0, 0 };
+    add_ngrams(&set, notes, (size_t) num_notes);
+    hash_set_finish(&set);
+    if (set.count == 0) {
+        free(set.hashes);
+        return 0;
+    }
+
+    epoch_enter(index->domain);
+    posting_view_t *views = malloc(set.count * sizeof(posting_view_t));
+    assert(views != NULL);
+    size_t num_query_ngrams = 0;
+    for (size_t i = 0; i < set.count; i++) {
+        posting_table_view(&index->ngrams, set.hashes[i], &views[i]);
+        if (!views[i].stopped) {
+            num_query_ngrams++;
+        }
+    }
+
+    int num_matches = 0;
+    if (num_query_ngrams > 0) {
+        size_t num_candidates;
+        uint32_t *candidates = gather_candidates(views, set.count, &num_candidates);
+        num_matches = collect_matches(index, candidates, num_candidates, melody_score, &num_query_ngrams,
+                                      min_score, matches, max_matches);
+        free(candidates);
+    }
+    epoch_exit(index->domain);
+
+    free(views);
+    free(set.hashes);
+    return num_matches;
+}
+
+static float signature_similarity(const indexed_song_t *entry, size_t hits, void *data) {
+    (void) hits;
+    const uint32_t *signature = (const uint32_t *) data;
+    int agree = 0;
+    for (int i = 0; i < MINHASH_SIZE; i++) {
+        if (entry->signature[i] == signature[i]) {
+            agree++;
+        }
+    }
+    return (float) agree / MINHASH_SIZE;
+}
+
+/*
+ * Find songs whose n-gram sets are close to the given song's. The score is
+ * the MinHash estimate of the Jaccard similarity. The song itself is included
+ * in the results if it is in the index.
+ */
+int similarity_find_near_duplicates(similarity_index_t *index, song_data_t *song, float min_score,
+                                    similarity_match_t *matches, int max_matches) {
+    assert(index != NULL && song != NULL && matches != NULL);
+
+    hash_set_t set = { NULL, 0, 0 };
+    extract_fingerprints(song, &set);
+    if (set.count == 0) {
+        free(set.hashes);
+        return 0;
+    }
+
+    uint32_t signature[MINHASH_SIZE];
+    compute_signature(&set, signature);
+    free(set.hashes);
+
+    epoch_enter(index->domain);
+    posting_view_t views[LSH_BANDS];
+    for (int band = 0; band < LSH_BANDS; band++) {
+        posting_table_view(&index->bands, band_key(signature, band), &views[band]);
+    }
+
+    size_t num_candidates;
+    uint32_t *candidates = gather_candidates(views, LSH_BANDS, &num_candidates);
+    int num_matches = collect_matches(index, candidates, num_candidates, signature_similarity, signature,
+                                      min_score, matches, max_matches);
+    epoch_exit(index->domain);
+
+    free(candidates);
+    return num_matches;
+}
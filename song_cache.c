@@ -0,0 +1,404 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "song_cache.h"
+#include "parser.h"
+#include "writer.h"
+
+/**
+ * This file contains a memory-budgeted LRU cache for the parsed contents of
+ * the songs in the library.
+ *
+ * Every song in the library keeps its name, filename, header and summary
+ * for the life of the process. Its track list, which holds nearly all of its
+ * memory, is only kept while it is in the cache. Evicting a song frees the
+ * track list and leaves track_list NULL. The next song_cache_acquire parses
+ * the file again and only takes the track list from it. The header and
+ * summary are never rewritten by a reload, since library readers look at
+ * them without any lock.
+ *
+ * Songs are pinned between song_cache_acquire and song_cache_release and are
+ * never evicted while pinned. The file is the only copy of an evicted song,
+ * so a pinned song that is altered must be written back with
+ * song_cache_write_back before it is released. The reloaded tracks then
+ * match the header and summary the alterations left behind.
+ */
+
+#define INITIAL_BUCKETS 1024
+
+typedef struct cache_entry {
+    song_data_t *song;
+    size_t bytes;
+    int pins;
+    bool loading;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    struct cache_entry *hash_next;
+} cache_entry_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t used_bytes;
+    size_t budget_bytes;
+    size_t num_resident;
+} cache_stats_t;
+
+typedef struct {
+    size_t budget_bytes;
+    size_t used_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    cache_entry_t **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+
+    // resident songs, most recently used first
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    size_t num_resident;
+
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+} song_cache_t;
+
+static size_t hash_song(const song_cache_t *cache, const song_data_t *song) {
+    uintptr_t x = (uintptr_t) song;
+    x ^= x >> 17;
+    x *= 0xED5AD4BBu;
+    x ^= x >> 11;
+    return (size_t) x & (cache->num_buckets - 1);
+}
+
+/*
+ * Rough number of bytes held by the song's track list.
+ */
+static size_t song_bytes(const song_data_t *song) {
+    size_t bytes = 0;
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        bytes += sizeof(track_node_t) + sizeof(track_t);
+        for (event_node_t *event_node = track_node->track->event_list; event_node != NULL; event_node = event_node->next) {
+            event_t *event = event_node->event;
+            bytes += sizeof(event_node_t) + sizeof(event_t);
+            if (event->type == META_EVENT) {
+                bytes += sizeof(meta_event_t) + ((meta_event_t *) event->data)->length;
+            } else if (event->type == SYS_EVENT_1 || event->type == SYS_EVENT_2) {
+                bytes += sizeof(sys_event_t) + ((sys_event_t *) event->data)->length;
+            } else {
+                bytes += sizeof(midi_event_t) + ((midi_event_t *) event->data)->data_length;
+            }
+        }
+    }
+    return bytes;
+}
+
+static void lru_unlink(song_cache_t *cache, cache_entry_t *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->lru_head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->lru_tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+    cache->num_resident--;
+}
+
+static void lru_push_front(song_cache_t *cache, cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = cache->lru_head;
+    if (cache->lru_head != NULL) {
+        cache->lru_head->prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+    cache->num_resident++;
+}
+
+static void grow_buckets(song_cache_t *cache) {
+    cache_entry_t **old_buckets = cache->buckets;
+    size_t old_num_buckets = cache->num_buckets;
+
+    cache->num_buckets *= 2;
+    cache->buckets = calloc(cache->num_buckets, sizeof(cache_entry_t *));
+    assert(cache->buckets != NULL);
+
+    for (size_t i = 0; i < old_num_buckets; i++) {
+        cache_entry_t *entry = old_buckets[i];
+        while (entry != NULL) {
+            cache_entry_t *next = entry->hash_next;
+            size_t bucket = hash_song(cache, entry->song);
+            entry->hash_next = cache->buckets[bucket];
+            cache->buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+}
+
+static cache_entry_t *find_entry(song_cache_t *cache, const song_data_t *song) {
+    for (cache_entry_t *entry = cache->buckets[hash_song(cache, song)]; entry != NULL; entry = entry->hash_next) {
+        if (entry->song == song) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the entry for song, adding one if the cache has not seen it yet.
+ * A song that arrives with its tracks already parsed becomes resident.
+ */
+static cache_entry_t *find_or_add_entry(song_cache_t *cache, song_data_t *song) {
+    cache_entry_t *entry = find_entry(cache, song);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    if (cache->num_entries + 1 > cache->num_buckets) {
+        grow_buckets(cache);
+    }
+    entry = calloc(1, sizeof(cache_entry_t));
+    assert(entry != NULL);
+    entry->song = song;
+    size_t bucket = hash_song(cache, song);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cache->num_entries++;
+
+    if (song->track_list != NULL) {
+        entry->bytes = song_bytes(song);
+        cache->used_bytes += entry->bytes;
+        lru_push_front(cache, entry);
+    }
+    return entry;
+}
+
+static void free_tracks(song_data_t *song) {
+    track_node_t *track_node = song->track_list;
+    while (track_node != NULL) {
+        track_node_t *next = track_node->next;
+        free_track_node(track_node);
+        track_node = next;
+    }
+    song->track_list = NULL;
+}
+
+/*
+ * Evict unpinned songs, least recently used first, until the cache fits in
+ * its budget or only pinned songs are left.
+ */
+static void evict_to_budget(song_cache_t *cache) {
+    cache_entry_t *entry = cache->lru_tail;
+    while (cache->used_bytes > cache->budget_bytes && entry != NULL) {
+        cache_entry_t *prev = entry->prev;
+        if (entry->pins == 0 && !entry->loading) {
+            lru_unlink(cache, entry);
+            free_tracks(entry->song);
+            cache->used_bytes -= entry->bytes;
+            entry->bytes = 0;
+            cache->evictions++;
+        }
+        entry = prev;
+    }
+}
+
+song_cache_t *new_song_cache(size_t budget_bytes) {
+    song_cache_t *cache = malloc(sizeof(song_cache_t));
+    assert(cache != NULL);
+    cache->budget_bytes = budget_bytes;
+    cache->used_bytes = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    cache->num_buckets = INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->num_buckets, sizeof(cache_entry_t *));
+    assert(cache->buckets != NULL);
+    cache->num_entries = 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->num_resident = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    return cache;
+}
+
+/*
+ * Free the cache's bookkeeping. Songs keep whatever tracks they have.
+ */
+void free_song_cache(song_cache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < cache->num_buckets; i++) {
+        cache_entry_t *entry = cache->buckets[i];
+        while (entry != NULL) {
+            cache_entry_t *next = entry->hash_next;
+            assert(entry->pins == 0 && !entry->loading);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    free(cache);
+}
+
+/*
+ * Hand a freshly parsed song to the cache, evicting older songs if the
+ * budget is exceeded. The song is not pinned.
+ */
+void song_cache_admit(song_cache_t *cache, song_data_t *song) {
+    assert(cache != NULL && song != NULL);
+    pthread_mutex_lock(&cache->lock);
+    find_or_add_entry(cache, song);
+    evict_to_budget(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Make sure the song's tracks are in memory, parsing its file again if they
+ * were evicted, and pin it. Every successful call must be matched by
+ * song_cache_release. Returns false, without pinning the song, if its file
+ * can no longer be parsed.
+ */
+bool song_cache_acquire(song_cache_t *cache, song_data_t *song) {
+    assert(cache != NULL && song != NULL);
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *entry = find_or_add_entry(cache, song);
+    entry->pins++;
+
+    // another thread is already parsing it
+    while (entry->loading) {
+        pthread_cond_wait(&cache->loaded, &cache->lock);
+    }
+
+    if (song->track_list != NULL) {
+        cache->hits++;
+        lru_unlink(cache, entry);
+        lru_push_front(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+
+    cache->misses++;
+    entry->loading = true;
+    pthread_mutex_unlock(&cache->lock);
+
+    // parse without holding the lock so other songs can still be served
+    song_data_t *loaded = parse_file(song->filename);
+    if (loaded == NULL) {
+        fprintf(stderr, "Warning: could not reload '%s'\n", song->filename);
+        pthread_mutex_lock(&cache->lock);
+        entry->pins--;
+        entry->loading = false;
+        pthread_cond_broadcast(&cache->loaded);
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+    size_t bytes = song_bytes(loaded);
+
+    pthread_mutex_lock(&cache->lock);
+    // the header and summary stay as they are, altered songs were written
+    // back so the file agrees with them
+    song->track_list = loaded->track_list;
+    loaded->track_list = NULL;
+    entry->bytes = bytes;
+    entry->loading = false;
+    cache->used_bytes += bytes;
+    lru_push_front(cache, entry);
+    evict_to_budget(cache);
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+
+    free_song(loaded);
+    return true;
+}
+
+/*
+ * Write a pinned song back to its file after it was altered, so the tracks
+ * parsed after an eviction match its header and summary. Returns 0 on
+ * success and -1 if the file could not be written.
+ */
+int song_cache_write_back(song_cache_t *cache, song_data_t *song) {
+    assert(cache != NULL && song != NULL);
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *entry = find_entry(cache, song);
+    assert(entry != NULL && entry->pins > 0);
+    pthread_mutex_unlock(&cache->lock);
+
+    // pinned, so the tracks cannot be evicted while they are written
+    return write_song_data(song, song->filename, NULL);
+}
+
+/*
+ * Unpin a song acquired with song_cache_acquire. Its tracks stay in memory
+ * until they are evicted.
+ */
+void song_cache_release(song_cache_t *cache, song_data_t *song) {
+    assert(cache != NULL && song != NULL);
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *entry = find_entry(cache, song);
+    assert(entry != NULL && entry->pins > 0);
+    entry->pins--;
+    evict_to_budget(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Drop the cache's entry for a song that is leaving the library. Its tracks
+ * are left for free_song.
+ */
+void song_cache_forget(song_cache_t *cache, song_data_t *song) {
+    assert(cache != NULL && song != NULL);
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t **link = &cache->buckets[hash_song(cache, song)];
+    while (*link != NULL && (*link)->song != song) {
+        link = &(*link)->hash_next;
+    }
+    cache_entry_t *entry = *link;
+    if (entry != NULL) {
+        assert(entry->pins == 0 && !entry->loading);
+        *link = entry->hash_next;
+        cache->num_entries--;
+        if (song->track_list != NULL) {
+            lru_unlink(cache, entry);
+            cache->used_bytes -= entry->bytes;
+        }
+        free(entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void song_cache_set_budget(song_cache_t *cache, size_t budget_bytes) {
+    assert(cache != NULL);
+    pthread_mutex_lock(&cache->lock);
+    cache->budget_bytes = budget_bytes;
+    evict_to_budget(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void song_cache_get_stats(song_cache_t *cache, cache_stats_t *stats) {
+    assert(cache != NULL && stats != NULL);
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->used_bytes = cache->used_bytes;
+    stats->budget_bytes = cache->budget_bytes;
+    stats->num_resident = cache->num_resident;
+    pthread_mutex_unlock(&cache->lock);
+}
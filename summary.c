@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "summary.h"
+
+/**
+ * This file contains the per-song summary: which channels are used, how many
+ * times each note and program occurs, and the length of the song in ticks.
+ *
+ * The summary is computed once while parsing and then kept up to date by each
+ * alteration, so questions like "which channel is free" or "what is the note
+ * range" never need to walk the song's events.
+ */
+
+#define NOTE_ON_STATUS 0x9
+#define PROGRAM_CHANGE_STATUS 0xC
+
+static void count_event(song_summary_t *summary, event_t *event) {
+    if (event->type == META_EVENT || event->type == SYS_EVENT_1 || event->type == SYS_EVENT_2) {
+        return;
+    }
+
+    midi_event_t *midi_event = (midi_event_t *) event->data;
+    uint8_t channel = midi_event->status & 0x0F;
+    summary->channel_events[channel]++;
+    summary->channel_mask |= (uint16_t) (1 << channel);
+
+    switch (midi_event->status >> 4) {
+        case NOTE_ON_STATUS:
+            // Note On with velocity 0 is a Note Off
+            if (midi_event->data[1] != 0) {
+                summary->note_counts[midi_event->data[0] & 0x7F]++;
+            }
+            break;
+        case PROGRAM_CHANGE_STATUS:
+            summary->program_counts[midi_event->data[0] & 0x7F]++;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Add every event of the track to the summary and extend the song length if
+ * the track is longer than the others.
+ */
+void summary_add_track(song_summary_t *summary, track_t *track) {
+    assert(summary != NULL && track != NULL);
+
+    uint32_t ticks = 0;
+    for (event_node_t *event_node = track->event_list; event_node != NULL; event_node = event_node->next) {
+        ticks += event_node->event->delta_time;
+        count_event(summary, event_node->event);
+    }
+    if (ticks > summary->total_ticks) {
+        summary->total_ticks = ticks;
+    }
+}
+
+void compute_song_summary(song_data_t *song) {
+    assert(song != NULL);
+
+    memset(&song->summary, 0, sizeof(song_summary_t));
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        summary_add_track(&song->summary, track_node->track);
+    }
+}
+
+/*
+ * Move counts according to mapping, where mapping[i] is the new value for i,
+ * or -1 to leave i alone.
+ */
+static void remap_counts(uint32_t counts[128], const int mapping[128]) {
+    uint32_t remapped[128] = { 0 };
+    for (int i = 0; i < 128; i++) {
+        int target = (mapping[i] == -1) ? i : mapping[i];
+        assert(target >= 0 && target < 128);
+        remapped[target] += counts[i];
+    }
+    memcpy(counts, remapped, sizeof(remapped));
+}
+
+void summary_remap_notes(song_summary_t *summary, const int mapping[128]) {
+    assert(summary != NULL && mapping != NULL);
+    remap_counts(summary->note_counts, mapping);
+}
+
+void summary_remap_programs(song_summary_t *summary, const int mapping[128]) {
+    assert(summary != NULL && mapping != NULL);
+    remap_counts(summary->program_counts, mapping);
+}
+
+/*
+ * Returns the smallest channel no event uses, or -1 if all 16 are taken.
+ */
+int summary_first_free_channel(const song_summary_t *summary) {
+    assert(summary != NULL);
+    if (summary->channel_mask == 0xFFFF) {
+        return -1;
+    }
+    return __builtin_ctz(~(unsigned int) summary->channel_mask);
+}
+
+int summary_num_channels(const song_summary_t *summary) {
+    assert(summary != NULL);
+    return __builtin_popcount(summary->channel_mask);
+}
+
+/*
+ * Returns the lowest note played in the song, or -1 if it has no notes.
+ */
+int summary_lowest_note(const song_summary_t *summary) {
+    assert(summary != NULL);
+    for (int i = 0; i < 128; i++) {
+        if (summary->note_counts[i] != 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the highest note played in the song, or -1 if it has no notes.
+ */
+int summary_highest_note(const song_summary_t *summary) {
+    assert(summary != NULL);
+    for (int i = 127; i >= 0; i--) {
+        if (summary->note_counts[i] != 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void print_summary(const song_summary_t *summary, FILE *fp) {
+    assert(summary != NULL && fp != NULL);
+    fprintf(fp, "channels: %d (mask 0x%04X), notes: %d-%d, ticks: %u, programs:",
+            summary_num_channels(summary), summary->channel_mask,
+            summary_lowest_note(summary), summary_highest_note(summary), summary->total_ticks);
+    for (int i = 0; i < 128; i++) {
+        if (summary->program_counts[i] != 0) {
+            fprintf(fp, " %d", i);
+        }
+    }
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "writer.h"
+
+/**
+ * This file contains functions for writing a parsed song back out as a
+ * standard MIDI file. Track lengths are recomputed from the events, and
+ * every MIDI event is written with its full status byte.
+ */
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} byte_buffer_t;
+
+static void reserve(byte_buffer_t *buffer, size_t extra) {
+    if (buffer->size + extra <= buffer->capacity) {
+        return;
+    }
+    while (buffer->size + extra > buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    }
+    buffer->data = realloc(buffer->data, buffer->capacity);
+    assert(buffer->data != NULL);
+}
+
+static void put_u8(byte_buffer_t *buffer, uint8_t value) {
+    reserve(buffer, 1);
+    buffer->data[buffer->size++] = value;
+}
+
+static void put_bytes(byte_buffer_t *buffer, const uint8_t *bytes, size_t length) {
+    reserve(buffer, length);
+    memcpy(buffer->data + buffer->size, bytes, length);
+    buffer->size += length;
+}
+
+static void put_be16(byte_buffer_t *buffer, uint16_t value) {
+    put_u8(buffer, (value >> 8) & 0xFF);
+    put_u8(buffer, value & 0xFF);
+}
+
+static void put_be32(byte_buffer_t *buffer, uint32_t value) {
+    put_u8(buffer, (value >> 24) & 0xFF);
+    put_u8(buffer, (value >> 16) & 0xFF);
+    put_u8(buffer, (value >> 8) & 0xFF);
+    put_u8(buffer, value & 0xFF);
+}
+
+static void put_var_len(byte_buffer_t *buffer, uint32_t value) {
+    uint8_t bytes[5];
+    int count = 0;
+    bytes[count++] = value & 0x7F;
+    while ((value >>= 7) != 0) {
+        bytes[count++] = (value & 0x7F) | 0x80;
+    }
+    while (count > 0) {
+        put_u8(buffer, bytes[--count]);
+    }
+}
+
+static void put_event(byte_buffer_t *buffer, event_t *event) {
+    put_var_len(buffer, event->delta_time);
+    if (event->type == META_EVENT) {
+        meta_event_t *meta_event = (meta_event_t *) event->data;
+        put_u8(buffer, META_EVENT);
+        put_u8(buffer, meta_event->type);
+        put_var_len(buffer, meta_event->length);
+        put_bytes(buffer, meta_event->data, meta_event->length);
+    } else if (event->type == SYS_EVENT_1 || event->type == SYS_EVENT_2) {
+        sys_event_t *sys_event = (sys_event_t *) event->data;
+        put_u8(buffer, event->type);
+        put_var_len(buffer, sys_event->length);
+        put_bytes(buffer, sys_event->data, sys_event->length);
+    } else {
+        midi_event_t *midi_event = (midi_event_t *) event->data;
+        put_u8(buffer, midi_event->status);
+        put_bytes(buffer, midi_event->data, midi_event->data_length);
+    }
+}
+
+/*
+ * Serialize the song into a newly allocated buffer and store its length in
+ * size. The caller frees the buffer.
+ */
+uint8_t *serialize_song(song_data_t *song, size_t *size) {
+    assert(song != NULL && size != NULL);
+
+    uint16_t num_tracks = 0;
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        num_tracks++;
+    }
+
+    byte_buffer_t buffer = { NULL, 0, 0 };
+    put_bytes(&buffer, (const uint8_t *) "MThd", 4);
+    put_be32(&buffer, 6);
+    put_be16(&buffer, (uint16_t) song->format);
+    put_be16(&buffer, num_tracks);
+    put_be16(&buffer, (uint16_t) song->ticks_per_quarter_note);
+
+    for (track_node_t *track_node = song->track_list; track_node != NULL; track_node = track_node->next) {
+        put_bytes(&buffer, (const uint8_t *) "MTrk", 4);
+        // length is filled in once the events are written
+        size_t length_offset = buffer.size;
+        put_be32(&buffer, 0);
+        for (event_node_t *event_node = track_node->track->event_list; event_node != NULL; event_node = event_node->next) {
+            put_event(&buffer, event_node->event);
+        }
+
+        uint32_t length = (uint32_t) (buffer.size - length_offset - 4);
+        track_node->track->length = length;
+        buffer.data[length_offset] = (length >> 24) & 0xFF;
+        buffer.data[length_offset + 1] = (length >> 16) & 0xFF;
+        buffer.data[length_offset + 2] = (length >> 8) & 0xFF;
+        buffer.data[length_offset + 3] = length & 0xFF;
+    }
+
+    *size = buffer.size;
+    return buffer.data;
+}
+
+/*
+ * Write the song to filename. Returns 0 on success, -1 if the file could
+ * not be written. If bytes_written is not NULL the size of the file is
+ * stored there on success.
+ */
+int write_song_data(song_data_t *song, const char *filename, size_t *bytes_written) {
+    assert(song != NULL && filename != NULL);
+
+    size_t size = 0;
+    uint8_t *data = serialize_song(song, &size);
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        free(data);
+        return -1;
+    }
+    size_t written = fwrite(data, 1, size, fp);
+    int result = (fclose(fp) == 0 && written == size) ? 0 : -1;
+    free(data);
+    if (result == 0 && bytes_written != NULL) {
+        *bytes_written = size;
+    }
+    return result;
+}